@@ -66,6 +66,34 @@
 /* BOOL */
 #define EVDEV_PROP_SWAP_AXES "Evdev Axes Swap"
 
+/* Events to process as if read from the device, write-only, only on
+ * devices with InjectEvents */
+/* CARD32, 3 values per event [type, code, value] */
+#define EVDEV_PROP_INJECT "Evdev Inject Events"
+
+/* Raw event recording to the RecordFile, only on devices that have one */
+/* BOOL */
+#define EVDEV_PROP_RECORD "Evdev Record"
+
+/* Writing 1 dumps the last events of the device to the log */
+/* BOOL */
+#define EVDEV_PROP_FLIGHT_RECORDER "Evdev Flight Recorder"
+
+/* Timeline tracing to the TraceFile, only on devices that have one */
+/* BOOL */
+#define EVDEV_PROP_TRACE "Evdev Trace"
+
+/* CPU time spent reading the device, read-only */
+/* CARD32, 6 values [total read, total process, total post,
+                     rate read, rate process, rate post]
+   totals in ms, rates in us per second */
+#define EVDEV_PROP_CPU_USAGE "Evdev CPU Usage"
+
+/* Time spent bringing the device up, in us, read-only */
+/* CARD32, 8 values [open, cache, probe, preinit, keymap, classes,
+                     properties, on] */
+#define EVDEV_PROP_STARTUP_TIMES "Evdev Startup Times"
+
 #ifdef _F_EVDEV_CONFINE_REGION_
 /* Confine region in which relative and absolute devices can be moved */
 #define EVDEV_PROP_CONFINE_REGION "Evdev Confine Region"
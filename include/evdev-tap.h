@@ -0,0 +1,73 @@
+/*
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of the authors
+ * not be used in advertising or publicity pertaining to distribution
+ * of the software without specific, written prior permission.  The
+ * authors make no representations about the suitability of this software
+ * for any purpose.  It is provided "as is" without express or implied
+ * warranty.
+ *
+ * THE AUTHORS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Layout of the TapFile, a ring of the events of one device that other
+ * processes can mmap and read without talking to the server.
+ *
+ * The file is one EvdevTapHeader followed by `size` EvdevTapEntries. The
+ * driver is the only writer. Entry n (counting from 1) is stored at index
+ * n & (size - 1); header->head is the number of the next entry to be
+ * written.
+ *
+ * To write entry n the driver sets its seq to 0, fills it in, sets seq to
+ * n and only then advances head, with a memory barrier between each step.
+ * A reader that wants entry n reads head to see that it has been written,
+ * copies the entry, and uses the copy only if seq was n both before and
+ * after copying. A different seq means the reader fell more than `size`
+ * entries behind and entry n has been overwritten.
+ */
+
+#ifndef _EVDEV_TAP_H_
+#define _EVDEV_TAP_H_
+
+#include <stdint.h>
+
+#define EVDEV_TAP_MAGIC     "EVDEVTAP"
+#define EVDEV_TAP_VERSION   1
+
+/* Entry kinds */
+#define EVDEV_TAP_RAW       0   /* event read from the device: type, code */
+#define EVDEV_TAP_KEY       1   /* key posted: code is the X keycode */
+#define EVDEV_TAP_BUTTON    2   /* button posted: code is the button */
+#define EVDEV_TAP_REL       3   /* relative motion: code is the valuator */
+#define EVDEV_TAP_ABS       4   /* absolute motion: code is the valuator */
+
+typedef struct {
+    char                magic[8];       /* EVDEV_TAP_MAGIC, not terminated */
+    uint32_t            version;
+    uint32_t            header_size;    /* offset of the first entry */
+    uint32_t            size;           /* entries, a power of two */
+    volatile uint32_t   head;           /* number of the next entry */
+    char                name[256];
+} EvdevTapHeader;
+
+typedef struct {
+    volatile uint32_t   seq;            /* number of the entry, 0 if busy */
+    uint16_t            kind;           /* EVDEV_TAP_* */
+    uint16_t            type;           /* EV_* for raw events */
+    uint16_t            code;
+    uint16_t            reserved;
+    int32_t             value;          /* 0/1 for keys and buttons */
+    uint32_t            sec;            /* kernel timestamp of the event */
+    uint32_t            usec;           /* or of the frame that was posted */
+} EvdevTapEntry;
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of the authors
+ * not be used in advertising or publicity pertaining to distribution
+ * of the software without specific, written prior permission.  The
+ * authors make no representations about the suitability of this software
+ * for any purpose.  It is provided "as is" without express or implied
+ * warranty.
+ *
+ * THE AUTHORS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Accounting of the CPU time the server spends in EvdevReadInput.
+ *
+ * One in EVDEV_CPU_SAMPLE reads is measured with the thread CPU clock,
+ * split into the read() itself, processing the events and posting the
+ * frames. The measurements are scaled up to estimate the totals, and
+ * folded into a moving average about once a second. The numbers are
+ * published through the read-only "Evdev CPU Usage" property, which is
+ * refreshed whenever a client reads it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <X11/Xatom.h>
+#include <xf86.h>
+#include <xf86Xinput.h>
+#include <exevents.h>
+
+#include <string.h>
+#include <time.h>
+
+#include <evdev-properties.h>
+#include "evdev.h"
+
+#ifndef CLOCK_THREAD_CPUTIME_ID
+#define CLOCK_THREAD_CPUTIME_ID CLOCK_MONOTONIC
+#endif
+
+#define EVDEV_CPU_WINDOW 1000   /* ms between moving average updates */
+
+#ifdef HAVE_PROPERTIES
+static Atom prop_cpu = 0;       /* CPU usage, read-only */
+static BOOL cpu_updating = FALSE; /* the driver is changing prop_cpu */
+#endif
+
+/**
+ * @return The CPU time of the calling thread in nanoseconds.
+ */
+long long
+EvdevCpuNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Fold the time accumulated since the last update into the moving
+ * average, once per EVDEV_CPU_WINDOW ms that have passed. The time goes
+ * into the first window, the windows after it were idle. The windows stay
+ * aligned to window_start, so the result doesn't depend on how often this
+ * is called.
+ */
+static void
+EvdevCpuFold(EvdevPtr pEvdev, CARD32 now)
+{
+    CARD32 windows, n;
+    unsigned int rate;
+    int i;
+
+    windows = (now - pEvdev->cpu_stats.window_start) / EVDEV_CPU_WINDOW;
+    if (!windows)
+        return;
+
+    /* ns per ms == us per s */
+    for (i = 0; i < EV_CPU_STAGES; i++)
+    {
+        rate = (3 * pEvdev->cpu_stats.rate[i] +
+                pEvdev->cpu_stats.window[i] / EVDEV_CPU_WINDOW) / 4;
+        for (n = 1; n < windows && rate; n++)
+            rate = 3 * rate / 4;
+        pEvdev->cpu_stats.rate[i] = rate;
+        pEvdev->cpu_stats.window[i] = 0;
+    }
+
+    pEvdev->cpu_stats.window_start += windows * EVDEV_CPU_WINDOW;
+}
+
+/**
+ * Account the stages of a sampled read. Called from EvdevReadInput,
+ * possibly in signal context.
+ */
+void
+EvdevCpuAccount(InputInfoPtr pInfo, long long read, long long process)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    long long ns[EV_CPU_STAGES];
+    int i;
+
+    ns[EV_CPU_READ] = read;
+    ns[EV_CPU_PROCESS] = process - pEvdev->cpu.post;
+    ns[EV_CPU_POST] = pEvdev->cpu.post;
+    pEvdev->cpu.post = 0;
+
+    for (i = 0; i < EV_CPU_STAGES; i++)
+    {
+        pEvdev->cpu_stats.total[i] += ns[i] * EVDEV_CPU_SAMPLE;
+        pEvdev->cpu_stats.window[i] += ns[i] * EVDEV_CPU_SAMPLE;
+    }
+
+    EvdevCpuFold(pEvdev, GetTimeInMillis());
+}
+
+void
+EvdevCpuPreInit(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+
+    memset(&pEvdev->cpu, 0, sizeof(pEvdev->cpu));
+    memset(&pEvdev->cpu_stats, 0, sizeof(pEvdev->cpu_stats));
+    pEvdev->cpu_stats.window_start = GetTimeInMillis();
+}
+
+#ifdef HAVE_PROPERTIES
+static int
+EvdevCpuSetProperty(DeviceIntPtr dev, Atom atom, XIPropertyValuePtr val,
+                    BOOL checkonly)
+{
+    if (atom == prop_cpu && !cpu_updating)
+        return BadAccess; /* Read-only property */
+
+    return Success;
+}
+
+/**
+ * Refresh the property before a client reads it, totals first, then the
+ * moving averages, each in the order read, process, post.
+ */
+static int
+EvdevCpuGetProperty(DeviceIntPtr dev, Atom atom)
+{
+    InputInfoPtr pInfo  = dev->public.devicePrivate;
+    EvdevPtr     pEvdev = pInfo->private;
+    CARD32       usage[2 * EV_CPU_STAGES];
+    int          i, block, rc;
+
+    if (atom != prop_cpu)
+        return Success;
+
+    block = xf86BlockSIGIO();
+    EvdevCpuFold(pEvdev, GetTimeInMillis());
+    for (i = 0; i < EV_CPU_STAGES; i++)
+    {
+        /* ms, microseconds would wrap after 71 minutes of input */
+        usage[i] = pEvdev->cpu_stats.total[i] / 1000000;
+        usage[EV_CPU_STAGES + i] = pEvdev->cpu_stats.rate[i];
+    }
+    xf86UnblockSIGIO(block);
+
+    cpu_updating = TRUE;
+    rc = XIChangeDeviceProperty(dev, prop_cpu, XA_INTEGER, 32,
+                                PropModeReplace, 2 * EV_CPU_STAGES, usage,
+                                FALSE);
+    cpu_updating = FALSE;
+
+    return rc;
+}
+
+void
+EvdevCpuInitProperty(DeviceIntPtr dev)
+{
+    CARD32 usage[2 * EV_CPU_STAGES];
+    int rc;
+
+    memset(usage, 0, sizeof(usage));
+
+    prop_cpu = MakeAtom(EVDEV_PROP_CPU_USAGE, strlen(EVDEV_PROP_CPU_USAGE),
+                        TRUE);
+    rc = XIChangeDeviceProperty(dev, prop_cpu, XA_INTEGER, 32,
+                                PropModeReplace, 2 * EV_CPU_STAGES, usage,
+                                FALSE);
+    if (rc != Success)
+        return;
+
+    XISetDevicePropertyDeletable(dev, prop_cpu, FALSE);
+
+    XIRegisterPropertyHandler(dev, EvdevCpuSetProperty, EvdevCpuGetProperty,
+                              NULL);
+}
+#endif
@@ -116,8 +116,8 @@ EvdevDragLockPreInit(InputInfoPtr pInfo)
             } else {
 
                 /* Do bounds checking to make sure we don't crash */
-                if ((meta_button <= EVDEV_MAXBUTTONS) && (meta_button >= 0 ) &&
-                    (lock_button <= EVDEV_MAXBUTTONS) && (lock_button >= 0)) {
+                if ((meta_button <= pEvdev->num_buttons) && (meta_button >= 0 ) &&
+                    (lock_button <= pEvdev->num_buttons) && (lock_button >= 0)) {
 
                     xf86Msg(X_CONFIG, "%s: DragLockButtons : %i -> %i\n",
                             pInfo->name, meta_button, lock_button);
@@ -174,7 +174,7 @@ EvdevDragLockFilterEvent(InputInfoPtr pInfo, unsigned int button, int value)
 {
     EvdevPtr pEvdev = (EvdevPtr)pInfo->private;
 
-    if (button == 0)
+    if (button == 0 || button > pEvdev->num_buttons)
         return FALSE;
 
     /* Do we have a single meta key or
@@ -238,7 +238,7 @@ EvdevDragLockSetProperty(DeviceIntPtr dev, Atom atom, XIPropertyValuePtr val,
                 return BadAccess;
         } else
         {
-            for (i = 0; i < EVDEV_MAXBUTTONS; i++)
+            for (i = 0; i < pEvdev->num_buttons; i++)
                 if (pEvdev->dragLock.lock_state[i])
                     return BadValue;
         }
@@ -248,29 +248,34 @@ EvdevDragLockSetProperty(DeviceIntPtr dev, Atom atom, XIPropertyValuePtr val,
         else if (val->size == 1)
         {
             int meta = *((CARD8*)val->data);
-            if (meta > EVDEV_MAXBUTTONS)
+            if (meta > pEvdev->num_buttons)
                 return BadValue;
 
             if (!checkonly)
             {
                 pEvdev->dragLock.meta = meta;
-                memset(pEvdev->dragLock.lock_pair, 0, sizeof(pEvdev->dragLock.lock_pair));
+                memset(pEvdev->dragLock.lock_pair, 0,
+                       pEvdev->num_buttons * sizeof(*pEvdev->dragLock.lock_pair));
+                EvdevInitDispatch(pInfo);
             }
         } else if ((val->size % 2) == 0)
         {
             CARD8* vals = (CARD8*)val->data;
 
-            for (i = 0; i < val->size && i < EVDEV_MAXBUTTONS; i++)
-                if (vals[i] > EVDEV_MAXBUTTONS)
+            for (i = 0; i < val->size; i++)
+                if (vals[i] > pEvdev->num_buttons)
                     return BadValue;
 
             if (!checkonly)
             {
                 pEvdev->dragLock.meta = 0;
-                memset(pEvdev->dragLock.lock_pair, 0, sizeof(pEvdev->dragLock.lock_pair));
+                memset(pEvdev->dragLock.lock_pair, 0,
+                       pEvdev->num_buttons * sizeof(*pEvdev->dragLock.lock_pair));
 
-                for (i = 0; i < val->size && i < EVDEV_MAXBUTTONS; i += 2)
-                    pEvdev->dragLock.lock_pair[vals[i] - 1] = vals[i + 1];
+                for (i = 0; i < val->size; i += 2)
+                    if (vals[i])
+                        pEvdev->dragLock.lock_pair[vals[i] - 1] = vals[i + 1];
+                EvdevInitDispatch(pInfo);
             }
         } else
             return BadMatch;
@@ -302,7 +307,7 @@ EvdevDragLockInitProperty(DeviceIntPtr dev)
         int i;
         CARD8 pair[EVDEV_MAXBUTTONS] = {0};
 
-        for (i = 0; i < EVDEV_MAXBUTTONS; i++)
+        for (i = 0; i < pEvdev->num_buttons; i++)
         {
             if (pEvdev->dragLock.lock_pair[i])
                 highest = i;
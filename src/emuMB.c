@@ -41,6 +41,7 @@
 
 #include <evdev-properties.h>
 #include "evdev.h"
+#include "evdev-trace.h"
 
 enum {
     MBEMU_DISABLED = 0,
@@ -193,8 +194,12 @@ EvdevMBEmuTimer(InputInfoPtr pInfo)
     EvdevPtr pEvdev = pInfo->private;
     int	sigstate;
     int id;
+    long long t = 0;
 
     sigstate = xf86BlockSIGIO ();
+    EvdevTraceBegin(pEvdev, t);
+
+    EVDEV_PROBE2(mbemu_timer, pInfo->name, pEvdev->emulateMB.state);
 
     pEvdev->emulateMB.pending = FALSE;
     if ((id = stateTab[pEvdev->emulateMB.state][4][0]) != 0) {
@@ -206,6 +211,7 @@ EvdevMBEmuTimer(InputInfoPtr pInfo)
                 pEvdev->emulateMB.state);
     }
 
+    EvdevTraceEnd(pInfo, pEvdev, EV_TRACE_MBEMU, t);
     xf86UnblockSIGIO (sigstate);
     return 0;
 }
@@ -353,7 +359,10 @@ EvdevMBEmuEnable(InputInfoPtr pInfo, BOOL enable)
 {
     EvdevPtr pEvdev = (EvdevPtr)pInfo->private;
     if (pEvdev->emulateMB.enabled == MBEMU_AUTO)
+    {
         pEvdev->emulateMB.enabled = enable;
+        EvdevInitDispatch(pInfo);
+    }
 }
 
 
@@ -371,7 +380,10 @@ EvdevMBEmuSetProperty(DeviceIntPtr dev, Atom atom, XIPropertyValuePtr val,
             return BadMatch;
 
         if (!checkonly)
+        {
             pEvdev->emulateMB.enabled = *((BOOL*)val->data);
+            EvdevInitDispatch(pInfo);
+        }
     } else if (atom == prop_mbtimeout)
     {
         if (val->format != 32 || val->size != 1 || val->type != XA_INTEGER)
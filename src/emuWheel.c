@@ -352,6 +352,7 @@ EvdevWheelEmuSetProperty(DeviceIntPtr dev, Atom atom, XIPropertyValuePtr val,
                             16, PropModeReplace, 1,
                             &pEvdev->emulateWheel.inertia, TRUE);
             }
+            EvdevInitDispatch(pInfo);
         }
     }
     else if (atom == prop_wheel_button)
@@ -363,7 +364,7 @@ EvdevWheelEmuSetProperty(DeviceIntPtr dev, Atom atom, XIPropertyValuePtr val,
 
         bt = *((CARD8*)val->data);
 
-        if (bt < 0 || bt >= EVDEV_MAXBUTTONS)
+        if (bt < 0 || bt > EVDEV_MAXBUTTONS)
             return BadValue;
 
         if (!checkonly)
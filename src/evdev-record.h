@@ -0,0 +1,80 @@
+/*
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of the authors
+ * not be used in advertising or publicity pertaining to distribution
+ * of the software without specific, written prior permission.  The
+ * authors make no representations about the suitability of this software
+ * for any purpose.  It is provided "as is" without express or implied
+ * warranty.
+ *
+ * THE AUTHORS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Format of the files written by the driver's "Evdev Record" property and
+ * read by evdev-replay.
+ *
+ * A recording is one EvdevRecordHeader followed by EvdevRecordEvents up to
+ * the end of the file. All fields are fixed size and in host byte order,
+ * the sizes of the bitmasks do not depend on the kernel headers the
+ * driver was built against. Files can be mmap'ed and indexed directly.
+ */
+
+#ifndef _EVDEV_RECORD_H_
+#define _EVDEV_RECORD_H_
+
+#include <stdint.h>
+
+#define EVDEV_RECORD_MAGIC      "EVDEVREC"
+#define EVDEV_RECORD_VERSION    1
+
+#define EVDEV_RECORD_EV_CNT     0x20
+#define EVDEV_RECORD_KEY_CNT    0x300
+#define EVDEV_RECORD_REL_CNT    0x10
+#define EVDEV_RECORD_ABS_CNT    0x40
+
+typedef struct {
+    int32_t     value;
+    int32_t     minimum;
+    int32_t     maximum;
+    int32_t     fuzz;
+    int32_t     flat;
+} EvdevRecordAbsInfo;
+
+typedef struct {
+    char        magic[8];       /* EVDEV_RECORD_MAGIC, not terminated */
+    uint32_t    version;
+    uint32_t    header_size;    /* offset of the first event */
+    uint16_t    bustype;
+    uint16_t    vendor;
+    uint16_t    product;
+    uint16_t    id_version;
+    char        name[256];
+    /* bit n of byte n / 8 is set if the device has code n */
+    uint8_t     ev_bits[EVDEV_RECORD_EV_CNT / 8];
+    uint8_t     key_bits[EVDEV_RECORD_KEY_CNT / 8];
+    uint8_t     rel_bits[EVDEV_RECORD_REL_CNT / 8];
+    uint8_t     abs_bits[EVDEV_RECORD_ABS_CNT / 8];
+    uint8_t     reserved[2];
+    EvdevRecordAbsInfo absinfo[EVDEV_RECORD_ABS_CNT];
+} EvdevRecordHeader;
+
+typedef struct {
+    uint32_t    sec;            /* kernel timestamp of the event */
+    uint32_t    usec;
+    uint16_t    type;
+    uint16_t    code;
+    int32_t     value;
+} EvdevRecordEvent;
+
+#define EvdevRecordTestBit(bit, array) ((array)[(bit) / 8] & (1 << ((bit) % 8)))
+
+#endif
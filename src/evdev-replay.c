@@ -0,0 +1,235 @@
+/*
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of the authors
+ * not be used in advertising or publicity pertaining to distribution
+ * of the software without specific, written prior permission.  The
+ * authors make no representations about the suitability of this software
+ * for any purpose.  It is provided "as is" without express or implied
+ * warranty.
+ *
+ * THE AUTHORS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Replay a recording made through the "Evdev Record" property.
+ *
+ * A uinput device with the recorded name, id, capabilities and axis ranges
+ * is created, so the server hotplugs it and the events go through the
+ * driver exactly like the original device's did. The events are then
+ * written at the recorded pace, or as fast as possible with -f.
+ *
+ * Usage: evdev-replay [-f] [-w seconds] recording
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include "evdev-record.h"
+
+static const struct {
+    int type;
+    int bit_ioctl;
+    int count;
+} bit_types[] = {
+    { EV_KEY, UI_SET_KEYBIT, EVDEV_RECORD_KEY_CNT },
+    { EV_REL, UI_SET_RELBIT, EVDEV_RECORD_REL_CNT },
+    { EV_ABS, UI_SET_ABSBIT, EVDEV_RECORD_ABS_CNT },
+};
+
+static const uint8_t *
+record_bits(const EvdevRecordHeader *header, int type)
+{
+    switch (type) {
+    case EV_KEY: return header->key_bits;
+    case EV_REL: return header->rel_bits;
+    case EV_ABS: return header->abs_bits;
+    }
+    return NULL;
+}
+
+static int
+create_device(const EvdevRecordHeader *header)
+{
+    struct uinput_user_dev dev;
+    int fd, i, j;
+
+    fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (fd == -1)
+        fd = open("/dev/input/uinput", O_WRONLY | O_NONBLOCK);
+    if (fd == -1) {
+        perror("evdev-replay: cannot open uinput");
+        return -1;
+    }
+
+    for (i = 0; i < EVDEV_RECORD_EV_CNT && i <= EV_MAX; i++)
+        if (EvdevRecordTestBit(i, header->ev_bits) && i != EV_SYN)
+            ioctl(fd, UI_SET_EVBIT, i);
+
+    for (i = 0; i < sizeof(bit_types) / sizeof(bit_types[0]); i++) {
+        const uint8_t *bits = record_bits(header, bit_types[i].type);
+
+        if (!EvdevRecordTestBit(bit_types[i].type, header->ev_bits))
+            continue;
+        for (j = 0; j < bit_types[i].count; j++)
+            if (EvdevRecordTestBit(j, bits))
+                ioctl(fd, bit_types[i].bit_ioctl, j);
+    }
+
+    memset(&dev, 0, sizeof(dev));
+    /* dev is zeroed, the name stays terminated */
+    memcpy(dev.name, header->name, sizeof(dev.name) - 1);
+    dev.id.bustype = header->bustype;
+    dev.id.vendor = header->vendor;
+    dev.id.product = header->product;
+    dev.id.version = header->id_version;
+
+    for (i = 0; i < EVDEV_RECORD_ABS_CNT && i < ABS_CNT; i++) {
+        dev.absmin[i] = header->absinfo[i].minimum;
+        dev.absmax[i] = header->absinfo[i].maximum;
+        dev.absfuzz[i] = header->absinfo[i].fuzz;
+        dev.absflat[i] = header->absinfo[i].flat;
+    }
+
+    if (write(fd, &dev, sizeof(dev)) != sizeof(dev) ||
+        ioctl(fd, UI_DEV_CREATE) == -1) {
+        perror("evdev-replay: cannot create uinput device");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static long long
+now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+int
+main(int argc, char **argv)
+{
+    const EvdevRecordHeader *header;
+    const EvdevRecordEvent *events;
+    size_t i, nevents;
+    struct stat st;
+    long long start_us = 0, first_us = 0;
+    int fast = 0, settle = 1;
+    int opt, fd, ufd;
+    void *map;
+
+    while ((opt = getopt(argc, argv, "fw:")) != -1) {
+        switch (opt) {
+        case 'f': fast = 1; break;
+        case 'w': settle = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-f] [-w seconds] recording\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-f] [-w seconds] recording\n", argv[0]);
+        return 1;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    if (st.st_size < sizeof(EvdevRecordHeader)) {
+        fprintf(stderr, "%s: not a recording\n", argv[optind]);
+        return 1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    header = map;
+    if (memcmp(header->magic, EVDEV_RECORD_MAGIC, sizeof(header->magic)) ||
+        header->version != EVDEV_RECORD_VERSION ||
+        header->header_size < sizeof(EvdevRecordHeader) ||
+        header->header_size > st.st_size) {
+        fprintf(stderr, "%s: not a version %d recording\n", argv[optind],
+                EVDEV_RECORD_VERSION);
+        return 1;
+    }
+
+    events = (const EvdevRecordEvent *)((const char *)map + header->header_size);
+    nevents = (st.st_size - header->header_size) / sizeof(EvdevRecordEvent);
+
+    ufd = create_device(header);
+    if (ufd == -1)
+        return 1;
+
+    /* Give the server time to hotplug the device */
+    sleep(settle);
+
+    for (i = 0; i < nevents; i++) {
+        struct input_event ev;
+        long long t = events[i].sec * 1000000LL + events[i].usec;
+
+        if (!fast) {
+            if (i == 0) {
+                start_us = now_us();
+                first_us = t;
+            } else {
+                long long delay = (t - first_us) - (now_us() - start_us);
+                if (delay > 0)
+                    usleep(delay);
+            }
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.type = events[i].type;
+        ev.code = events[i].code;
+        ev.value = events[i].value;
+
+        while (write(ufd, &ev, sizeof(ev)) == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("evdev-replay: write");
+                goto out;
+            }
+            usleep(100);
+        }
+    }
+
+    printf("%s: replayed %zu events\n", header->name, nevents);
+
+out:
+    ioctl(ufd, UI_DEV_DESTROY);
+    close(ufd);
+    munmap(map, st.st_size);
+    close(fd);
+    return 0;
+}
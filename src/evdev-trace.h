@@ -0,0 +1,54 @@
+/*
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of the authors
+ * not be used in advertising or publicity pertaining to distribution
+ * of the software without specific, written prior permission.  The
+ * authors make no representations about the suitability of this software
+ * for any purpose.  It is provided "as is" without express or implied
+ * warranty.
+ *
+ * THE AUTHORS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Static tracepoints, provider "evdev". Built with --enable-dtrace, they are
+ * SystemTap-compatible USDT probes usable from perf, bpftrace and stap;
+ * otherwise they compile to nothing. The probe names and arguments are
+ * stable, unlike the static functions they sit in:
+ *
+ *   read_start(fd)
+ *   read_end(fd, bytes)                 bytes <= 0 on error or EAGAIN
+ *   event(name, type, code, value)      every event, before dispatch
+ *   syn_report(name, num_v, num_queue)  before posting a frame
+ *   queue_overflow(name, type, key)     type is EV_QUEUE_KEY/EV_QUEUE_BTN
+ *   mbemu_timer(name, state)            middle button emulation timeout
+ *   reopen(name, result)                1 reopened, 0 device changed,
+ *                                       -1 node not there yet
+ */
+
+#ifndef _EVDEV_TRACE_H_
+#define _EVDEV_TRACE_H_
+
+#ifdef ENABLE_DTRACE
+#include <sys/sdt.h>
+
+#define EVDEV_PROBE1(probe, a)          STAP_PROBE1(evdev, probe, a)
+#define EVDEV_PROBE2(probe, a, b)       STAP_PROBE2(evdev, probe, a, b)
+#define EVDEV_PROBE3(probe, a, b, c)    STAP_PROBE3(evdev, probe, a, b, c)
+#define EVDEV_PROBE4(probe, a, b, c, d) STAP_PROBE4(evdev, probe, a, b, c, d)
+#else
+#define EVDEV_PROBE1(probe, a)          do { } while (0)
+#define EVDEV_PROBE2(probe, a, b)       do { } while (0)
+#define EVDEV_PROBE3(probe, a, b, c)    do { } while (0)
+#define EVDEV_PROBE4(probe, a, b, c, d) do { } while (0)
+#endif
+
+#endif
@@ -34,9 +34,14 @@
 #include <X11/keysym.h>
 
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include <xf86.h>
 #include <xf86Xinput.h>
@@ -45,6 +50,8 @@
 #include <xkbsrv.h>
 
 #include "evdev.h"
+#include "evdev-trace.h"
+#include <evdev-tap.h>
 #ifdef _F_EVDEV_CONFINE_REGION_
 #include <xorg/mipointrst.h>
 
@@ -85,6 +92,15 @@
 #ifndef EV_SYN
 #define EV_SYN EV_RST
 #endif
+
+#ifndef EVIOCSMASK
+struct input_mask {
+    __u32 type;
+    __u32 codes_size;
+    __u64 codes_ptr;
+};
+#define EVIOCSMASK _IOW('E', 0x93, struct input_mask)
+#endif
 /* end compat */
 
 #define ArrayLength(a) (sizeof(a) / (sizeof((a)[0])))
@@ -105,6 +121,7 @@
 #ifdef _F_EVDEV_CONFINE_REGION_
 #define EVDEV_CONFINE_REGION	(1 << 13)
 #endif /* _F_EVDEV_CONFINE_REGION_ */
+#define EVDEV_MUTED		(1 << 14) /* switched off, but fd kept open */
 
 #define MIN_KEYCODE 8
 #define GLYPHS_PER_KEY 2
@@ -128,7 +145,12 @@ static const char *evdevDefaults[] = {
 };
 
 static int EvdevOn(DeviceIntPtr);
+static void EvdevReopenStop(InputInfoPtr pInfo);
+#ifdef HAVE_SYS_INOTIFY_H
+static BOOL EvdevReopenWatch(InputInfoPtr pInfo);
+#endif
 static int EvdevCacheCompare(InputInfoPtr pInfo, BOOL compare);
+static void EvdevInitButtonCodeMap(InputInfoPtr pInfo);
 static void EvdevKbdCtrl(DeviceIntPtr device, KeybdCtrl *ctrl);
 static void EvdevSwapAxes(EvdevPtr pEvdev);
 static void EvdevSetResolution(InputInfoPtr pInfo, int num_resolution, int resolution[4]);
@@ -137,8 +159,10 @@ static void EvdevSetResolution(InputInfoPtr pInfo, int num_resolution, int resol
 static void EvdevInitAxesLabels(EvdevPtr pEvdev, int natoms, Atom *atoms);
 static void EvdevInitButtonLabels(EvdevPtr pEvdev, int natoms, Atom *atoms);
 static void EvdevInitProperty(DeviceIntPtr dev);
+static void EvdevGroupRead(InputInfoPtr pInfo);
 static int EvdevSetProperty(DeviceIntPtr dev, Atom atom,
                             XIPropertyValuePtr val, BOOL checkonly);
+static int EvdevGetProperty(DeviceIntPtr dev, Atom atom);
 #ifdef _F_EVDEV_CONFINE_REGION_
 Bool IsMaster(DeviceIntPtr dev);
 DeviceIntPtr GetPairedDevice(DeviceIntPtr dev);
@@ -156,6 +180,8 @@ static Atom prop_calibration = 0;
 static Atom prop_swap = 0;
 static Atom prop_axis_label = 0;
 static Atom prop_btn_label = 0;
+static Atom prop_inject = 0;
+static BOOL inject_updating = FALSE; /* the driver is clearing prop_inject */
 #endif
 
 /* All devices the evdev driver has allocated and knows about.
@@ -163,6 +189,36 @@ static Atom prop_btn_label = 0;
  * cannot be used by evdev, leaving us with a space of 2 at the end. */
 static EvdevPtr evdev_devices[MAXDEVICES] = {NULL};
 
+static int
+EvdevSysOpen(const char *path, int flags)
+{
+    return open(path, flags, 0);
+}
+
+static int
+EvdevSysIoctl(int fd, unsigned long request, void *arg)
+{
+    return ioctl(fd, request, arg);
+}
+
+static int
+EvdevSysFstat(int fd, struct stat *st)
+{
+    return fstat(fd, st);
+}
+
+static const EvdevBackendRec evdev_sys_backend = {
+    EvdevSysOpen,
+    close,
+    EvdevSysIoctl,
+    read,
+    write,
+    EvdevSysFstat,
+    xf86FlushInput,
+};
+
+const EvdevBackendRec *evdev_backend = &evdev_sys_backend;
+
 static size_t EvdevCountBits(unsigned long *array, size_t nlongs)
 {
     unsigned int i;
@@ -185,7 +241,7 @@ EvdevGetMajorMinor(InputInfoPtr pInfo)
 {
     struct stat st;
 
-    if (fstat(pInfo->fd, &st) == -1)
+    if (evdev_backend->sys_fstat(pInfo->fd, &st) == -1)
     {
         xf86Msg(X_ERROR, "%s: stat failed (%s). cannot check for duplicates.\n",
                 pInfo->name, strerror(errno));
@@ -219,6 +275,37 @@ EvdevIsDuplicate(InputInfoPtr pInfo)
     return FALSE;
 }
 
+/**
+ * Set the device's group key for GroupByPhys: the phys path without its
+ * last "/inputN" component, which is all that differs between the nodes of
+ * the interfaces of one USB device.
+ */
+static void
+EvdevGroupPreInit(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    char *phys = pEvdev->group.phys;
+    char *c;
+
+    memset(phys, 0, sizeof(pEvdev->group.phys));
+    if (evdev_backend->sys_ioctl(pInfo->fd,
+                                 EVIOCGPHYS(sizeof(pEvdev->group.phys) - 1),
+                                 phys) < 0 || !phys[0])
+    {
+        xf86Msg(X_WARNING, "%s: No phys path, not grouping.\n", pInfo->name);
+        phys[0] = '\0';
+        return;
+    }
+
+    c = strrchr(phys, '/');
+    if (c && !strncmp(c, "/input", 6))
+        *c = '\0';
+
+    pEvdev->group.pInfo = pInfo;
+    xf86Msg(X_CONFIG, "%s: Grouping with siblings on %s\n", pInfo->name,
+            phys);
+}
+
 /**
  * Add to internal device list.
  */
@@ -304,8 +391,7 @@ EvdevQueueKbdEvent(InputInfoPtr pInfo, struct input_event *ev, int value)
     {
         if (ev->code <= KEY_MAX && !warned[ev->code])
         {
-            xf86Msg(X_WARNING, "%s: unable to handle keycode %d\n",
-                    pInfo->name, ev->code);
+            EvdevLog(pInfo, EVDEV_LOG_KEYCODE, ev->code);
             warned[ev->code] = 1;
         }
 
@@ -315,7 +401,9 @@ EvdevQueueKbdEvent(InputInfoPtr pInfo, struct input_event *ev, int value)
 
     if (pEvdev->num_queue >= EVDEV_MAXQUEUE)
     {
-        xf86Msg(X_NONE, "%s: dropping event due to full queue!\n", pInfo->name);
+        EVDEV_PROBE3(queue_overflow, pInfo->name, EV_QUEUE_KEY, code);
+        EvdevRingMark(pEvdev, EV_RING_DROPPED);
+        EvdevLog(pInfo, EVDEV_LOG_QUEUE_FULL, 0);
         return;
     }
 
@@ -324,6 +412,7 @@ EvdevQueueKbdEvent(InputInfoPtr pInfo, struct input_event *ev, int value)
     pQueue->key = code;
     pQueue->val = value;
     pEvdev->num_queue++;
+    EvdevRingMark(pEvdev, EV_RING_QUEUED);
 }
 
 void
@@ -334,7 +423,9 @@ EvdevQueueButtonEvent(InputInfoPtr pInfo, int button, int value)
 
     if (pEvdev->num_queue >= EVDEV_MAXQUEUE)
     {
-        xf86Msg(X_NONE, "%s: dropping event due to full queue!\n", pInfo->name);
+        EVDEV_PROBE3(queue_overflow, pInfo->name, EV_QUEUE_BTN, button);
+        EvdevRingMark(pEvdev, EV_RING_DROPPED);
+        EvdevLog(pInfo, EVDEV_LOG_QUEUE_FULL, 0);
         return;
     }
 
@@ -343,6 +434,7 @@ EvdevQueueButtonEvent(InputInfoPtr pInfo, int button, int value)
     pQueue->key = button;
     pQueue->val = value;
     pEvdev->num_queue++;
+    EvdevRingMark(pEvdev, EV_RING_QUEUED);
 }
 
 /**
@@ -352,7 +444,11 @@ EvdevQueueButtonEvent(InputInfoPtr pInfo, int button, int value)
 void
 EvdevPostButtonEvent(InputInfoPtr pInfo, int button, int value)
 {
+    EvdevPtr pEvdev = pInfo->private;
+
     xf86PostButtonEvent(pInfo->dev, 0, button, value, 0, 0);
+    if (pEvdev->tap.header)
+        EvdevTapWrite(pEvdev, EVDEV_TAP_BUTTON, 0, button, value);
 }
 
 void
@@ -366,40 +462,100 @@ EvdevQueueButtonClicks(InputInfoPtr pInfo, int button, int count)
     }
 }
 
+/**
+ * Try to open the device again and check it is still the same device.
+ *
+ * @return TRUE if the device was reopened or has been disabled because it
+ * changed, FALSE if the device node is not available (yet).
+ */
+static BOOL
+EvdevReopenDevice(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    long long t = 0;
+
+    EvdevTraceBegin(pEvdev, t);
+
+    do {
+        pInfo->fd = evdev_backend->sys_open(pEvdev->device, O_RDWR | O_NONBLOCK);
+    } while (pInfo->fd < 0 && errno == EINTR);
+
+    if (pInfo->fd == -1)
+    {
+        EVDEV_PROBE2(reopen, pInfo->name, -1);
+        EvdevTraceEnd(pInfo, pEvdev, EV_TRACE_REOPEN, t);
+        return FALSE;
+    }
+
+    if (EvdevCacheCompare(pInfo, TRUE) == Success)
+    {
+        EVDEV_PROBE2(reopen, pInfo->name, 1);
+        if (pEvdev->reopen_handler)
+            xf86Msg(X_INFO, "%s: Device reopened.\n", pInfo->name);
+        else
+            xf86Msg(X_INFO, "%s: Device reopened after %d attempts.\n",
+                    pInfo->name,
+                    pEvdev->reopen_attempts - pEvdev->reopen_left + 1);
+        EvdevReopenStop(pInfo);
+        pEvdev->reopen_left = 0;
+        EvdevOn(pInfo->dev);
+    } else
+    {
+        EVDEV_PROBE2(reopen, pInfo->name, 0);
+        xf86Msg(X_ERROR, "%s: Device has changed - disabling.\n",
+                pInfo->name);
+        EvdevReopenStop(pInfo);
+        pEvdev->reopen_left = 0;
+        xf86DisableDevice(pInfo->dev, FALSE);
+        evdev_backend->sys_close(pInfo->fd);
+        pInfo->fd = -1;
+        pEvdev->min_maj = 0; /* don't hog the device */
+    }
+
+    EvdevTraceEnd(pInfo, pEvdev, EV_TRACE_REOPEN, t);
+    return TRUE;
+}
+
 /**
  * Coming back from resume may leave us with a file descriptor that can be
  * opened but fails on the first read (ENODEV).
  * In this case, try to open the device until it becomes available or until
  * the predefined count expires.
+ *
+ * If the first attempt fails and the device's directory can be watched with
+ * inotify, the reopen is driven by the watch instead. The timer then fires
+ * once more right away, in case the node came back while the watch was set
+ * up, whenever EvdevReopenWatchRead() sees the node appear, and when the
+ * time for all attempts has run out. The watch is set up here rather than
+ * in EvdevReopenStart(), which may run in signal context.
  */
 static CARD32
 EvdevReopenTimer(OsTimerPtr timer, CARD32 time, pointer arg)
 {
     InputInfoPtr pInfo = (InputInfoPtr)arg;
     EvdevPtr pEvdev = pInfo->private;
+    int left;
 
-    do {
-        pInfo->fd = open(pEvdev->device, O_RDWR | O_NONBLOCK, 0);
-    } while (pInfo->fd < 0 && errno == EINTR);
+    if (EvdevReopenDevice(pInfo))
+        return 0;
 
-    if (pInfo->fd != -1)
+#ifdef HAVE_SYS_INOTIFY_H
+    if (!pEvdev->reopen_handler &&
+        pEvdev->reopen_left == pEvdev->reopen_attempts &&
+        EvdevReopenWatch(pInfo))
     {
-        if (EvdevCacheCompare(pInfo, TRUE) == Success)
-        {
-            xf86Msg(X_INFO, "%s: Device reopened after %d attempts.\n", pInfo->name,
-                    pEvdev->reopen_attempts - pEvdev->reopen_left + 1);
-            EvdevOn(pInfo->dev);
-        } else
-        {
-            xf86Msg(X_ERROR, "%s: Device has changed - disabling.\n",
-                    pInfo->name);
-            xf86DisableDevice(pInfo->dev, FALSE);
-            close(pInfo->fd);
-            pInfo->fd = -1;
-            pEvdev->min_maj = 0; /* don't hog the device */
-        }
-        pEvdev->reopen_left = 0;
-        return 0;
+        pEvdev->reopen_left = 1; /* fails at the deadline */
+        pEvdev->reopen_deadline = GetTimeInMillis() +
+                                  100 * max(pEvdev->reopen_attempts, 1);
+        return 1;
+    }
+#endif
+
+    if (pEvdev->reopen_handler)
+    {
+        left = pEvdev->reopen_deadline - GetTimeInMillis();
+        if (left > 0)
+            return left;
     }
 
     pEvdev->reopen_left--;
@@ -408,6 +564,7 @@ EvdevReopenTimer(OsTimerPtr timer, CARD32 time, pointer arg)
     {
         xf86Msg(X_ERROR, "%s: Failed to reopen device after %d attempts.\n",
                 pInfo->name, pEvdev->reopen_attempts);
+        EvdevReopenStop(pInfo);
         xf86DisableDevice(pInfo->dev, FALSE);
         pEvdev->min_maj = 0; /* don't hog the device */
         return 0;
@@ -416,6 +573,125 @@ EvdevReopenTimer(OsTimerPtr timer, CARD32 time, pointer arg)
     return 100; /* come back in 100 ms */
 }
 
+#ifdef HAVE_SYS_INOTIFY_H
+/**
+ * Called when the directory of the device node changed. If the node has
+ * (re)appeared, fire the reopen timer right away. The device isn't reopened
+ * from here: that removes this handler and switches the device on or off,
+ * neither of which is safe while the server walks its input handlers.
+ */
+static void
+EvdevReopenWatchRead(int fd, pointer data)
+{
+    InputInfoPtr pInfo = (InputInfoPtr)data;
+    EvdevPtr pEvdev = pInfo->private;
+    const char *name = strrchr(pEvdev->device, '/') + 1;
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+    BOOL appeared = FALSE;
+    int len;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+    {
+        char *p = buf;
+
+        while (p < buf + len)
+        {
+            struct inotify_event *iev = (struct inotify_event*)p;
+
+            if (iev->len && strcmp(iev->name, name) == 0)
+                appeared = TRUE;
+            p += sizeof(*iev) + iev->len;
+        }
+    }
+
+    if (appeared && pEvdev->reopen_timer)
+        pEvdev->reopen_timer = TimerSet(pEvdev->reopen_timer, 0, 1,
+                                        EvdevReopenTimer, pInfo);
+}
+
+/**
+ * Watch the directory of the device node for the node to reappear.
+ *
+ * @return TRUE if the watch is in place, FALSE otherwise.
+ */
+static BOOL
+EvdevReopenWatch(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    const char *name = strrchr(pEvdev->device, '/');
+    char dir[PATH_MAX];
+    int rc;
+
+    if (pEvdev->reopen_watch != -1)
+        return TRUE;
+
+    if (!name || name == pEvdev->device)
+        return FALSE;
+
+    pEvdev->reopen_watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (pEvdev->reopen_watch == -1)
+        return FALSE;
+
+    snprintf(dir, sizeof(dir), "%.*s", (int)(name - pEvdev->device),
+             pEvdev->device);
+    rc = inotify_add_watch(pEvdev->reopen_watch, dir,
+                           IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+
+    if (rc != -1)
+        pEvdev->reopen_handler = xf86AddInputHandler(pEvdev->reopen_watch,
+                                                     EvdevReopenWatchRead,
+                                                     pInfo);
+    if (!pEvdev->reopen_handler)
+    {
+        close(pEvdev->reopen_watch);
+        pEvdev->reopen_watch = -1;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+#endif
+
+/**
+ * Start trying to reopen the device. The first attempt is made right away
+ * from the timer, see EvdevReopenTimer() for the rest. Called from the
+ * input handler, so it does nothing but arm the timer.
+ */
+static void
+EvdevReopenStart(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+
+    pEvdev->reopen_left = pEvdev->reopen_attempts;
+    pEvdev->reopen_timer = TimerSet(pEvdev->reopen_timer, 0, 1,
+                                    EvdevReopenTimer, pInfo);
+}
+
+/**
+ * Stop trying to reopen the device.
+ */
+static void
+EvdevReopenStop(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+
+    if (pEvdev->reopen_timer)
+        TimerCancel(pEvdev->reopen_timer);
+
+#ifdef HAVE_SYS_INOTIFY_H
+    if (pEvdev->reopen_handler)
+    {
+        xf86RemoveInputHandler(pEvdev->reopen_handler);
+        pEvdev->reopen_handler = NULL;
+    }
+    if (pEvdev->reopen_watch != -1)
+    {
+        close(pEvdev->reopen_watch);
+        pEvdev->reopen_watch = -1;
+    }
+#endif
+}
+
 #define ABS_X_VALUE 0x1
 #define ABS_Y_VALUE 0x2
 #define ABS_VALUE   0x4
@@ -463,7 +739,7 @@ EvdevProcessValuators(InputInfoPtr pInfo, int v[MAX_VALUATORS], int *num_v,
         if (pEvdev->invert_y)
             pEvdev->delta[REL_Y] *= -1;
 
-        for (i = 0; i < REL_CNT; i++)
+        for (i = 0; i < REL_CNT && i < pEvdev->num_axis_codes; i++)
         {
             int map = pEvdev->axis_map[i];
             if (map != -1)
@@ -521,6 +797,19 @@ EvdevProcessValuators(InputInfoPtr pInfo, int v[MAX_VALUATORS], int *num_v,
     }
 }
 
+/**
+ * Event handlers. EvdevInitDispatch() picks one of these for each event
+ * code, based on the device type and the emulation settings, so the
+ * handlers themselves don't need to check either.
+ */
+static void
+EvdevIgnoreEvent(InputInfoPtr pInfo, struct input_event *ev)
+{
+    EvdevPtr pEvdev = pInfo->private;
+
+    EvdevRingMark(pEvdev, EV_RING_IGNORED);
+}
+
 /**
  * Take a button input event and process it accordingly.
  */
@@ -531,20 +820,23 @@ EvdevProcessButtonEvent(InputInfoPtr pInfo, struct input_event *ev)
     int value;
     EvdevPtr pEvdev = pInfo->private;
 
-    button = EvdevUtilButtonEventToButtonNumber(pEvdev, ev->code);
-
     /* Get the signed value, earlier kernels had this as unsigned */
     value = ev->value;
 
-    /* Handle drag lock */
-    if (EvdevDragLockFilterEvent(pInfo, button, value))
+    /* don't repeat mouse buttons */
+    if (value == 2)
         return;
 
-    if (EvdevWheelEmuFilterButton(pInfo, button, value))
-        return;
+    button = EvdevUtilButtonEventToButtonNumber(pEvdev, ev->code);
 
-    if (EvdevMBEmuFilterEvent(pInfo, button, value))
+    /* Handle drag lock */
+    if (EvdevDragLockFilterEvent(pInfo, button, value) ||
+        EvdevWheelEmuFilterButton(pInfo, button, value) ||
+        EvdevMBEmuFilterEvent(pInfo, button, value))
+    {
+        EvdevRingMark(pEvdev, EV_RING_SWALLOWED);
         return;
+    }
 
     if (button)
         EvdevQueueButtonEvent(pInfo, button, value);
@@ -553,120 +845,154 @@ EvdevProcessButtonEvent(InputInfoPtr pInfo, struct input_event *ev)
 }
 
 /**
- * Take the relative motion input event and process it accordingly.
+ * Take a button input event from a device without drag lock, wheel or
+ * middle button emulation and queue it.
  */
 static void
-EvdevProcessRelativeMotionEvent(InputInfoPtr pInfo, struct input_event *ev)
+EvdevProcessPlainButtonEvent(InputInfoPtr pInfo, struct input_event *ev)
 {
-    static int value;
     EvdevPtr pEvdev = pInfo->private;
 
-    /* Get the signed value, earlier kernels had this as unsigned */
-    value = ev->value;
-
-    pEvdev->rel = 1;
+    /* don't repeat mouse buttons */
+    if (ev->value == 2)
+        return;
 
-    switch (ev->code) {
-        case REL_WHEEL:
-            if (value > 0)
-                EvdevQueueButtonClicks(pInfo, wheel_up_button, value);
-            else if (value < 0)
-                EvdevQueueButtonClicks(pInfo, wheel_down_button, -value);
-            break;
+    EvdevQueueButtonEvent(pInfo,
+                          EvdevUtilButtonEventToButtonNumber(pEvdev, ev->code),
+                          ev->value);
+}
 
-        case REL_DIAL:
-        case REL_HWHEEL:
-            if (value > 0)
-                EvdevQueueButtonClicks(pInfo, wheel_right_button, value);
-            else if (value < 0)
-                EvdevQueueButtonClicks(pInfo, wheel_left_button, -value);
-            break;
+/**
+ * Take the key press/release input event and process it accordingly.
+ */
+static void
+EvdevProcessKeyEvent(InputInfoPtr pInfo, struct input_event *ev)
+{
+    EvdevQueueKbdEvent(pInfo, ev, ev->value);
+}
 
-        /* We don't post wheel events as axis motion. */
-        default:
-            /* Ignore EV_REL events if we never set up for them. */
-            if (!(pEvdev->flags & EVDEV_RELATIVE_EVENTS))
-                return;
+/**
+ * Take a BTN_TOOL_* or BTN_TOUCH event and update the tool in proximity.
+ */
+static void
+EvdevProcessToolEvent(InputInfoPtr pInfo, struct input_event *ev)
+{
+    EvdevPtr pEvdev = pInfo->private;
 
-            /* Handle mouse wheel emulation */
-            if (EvdevWheelEmuFilterMotion(pInfo, ev))
-                return;
+    if (ev->value == 2)
+        return;
 
-            pEvdev->delta[ev->code] += value;
-            break;
-    }
+    pEvdev->tool = ev->value ? ev->code : 0;
 }
 
 /**
- * Take the absolute motion input event and process it accordingly.
+ * Take a BTN_TOUCH event from a touchscreen or tablet. Treat BTN_TOUCH from
+ * devices that only have BTN_TOUCH as BTN_LEFT.
  */
 static void
-EvdevProcessAbsoluteMotionEvent(InputInfoPtr pInfo, struct input_event *ev)
+EvdevProcessTouchEvent(InputInfoPtr pInfo, struct input_event *ev)
 {
-    static int value;
     EvdevPtr pEvdev = pInfo->private;
 
+    if (ev->value == 2)
+        return;
+
+    pEvdev->tool = ev->value ? ev->code : 0;
+    ev->code = BTN_LEFT;
+    EvdevProcessButtonEvent(pInfo, ev);
+}
+
+/**
+ * Take a REL_WHEEL event and queue the button clicks for it.
+ */
+static void
+EvdevProcessWheelEvent(InputInfoPtr pInfo, struct input_event *ev)
+{
     /* Get the signed value, earlier kernels had this as unsigned */
-    value = ev->value;
+    int value = ev->value;
 
-    /* Ignore EV_ABS events if we never set up for them. */
-    if (!(pEvdev->flags & EVDEV_ABSOLUTE_EVENTS))
-        return;
+    if (value > 0)
+        EvdevQueueButtonClicks(pInfo, wheel_up_button, value);
+    else if (value < 0)
+        EvdevQueueButtonClicks(pInfo, wheel_down_button, -value);
+}
+
+/**
+ * Take a REL_HWHEEL or REL_DIAL event and queue the button clicks for it.
+ */
+static void
+EvdevProcessHWheelEvent(InputInfoPtr pInfo, struct input_event *ev)
+{
+    int value = ev->value;
+
+    if (value > 0)
+        EvdevQueueButtonClicks(pInfo, wheel_right_button, value);
+    else if (value < 0)
+        EvdevQueueButtonClicks(pInfo, wheel_left_button, -value);
+}
+
+/**
+ * Take the relative motion input event and process it accordingly.
+ * We don't post wheel events as axis motion, see EvdevProcessWheelEvent.
+ */
+static void
+EvdevProcessRelativeMotionEvent(InputInfoPtr pInfo, struct input_event *ev)
+{
+    EvdevPtr pEvdev = pInfo->private;
+
+    pEvdev->rel = 1;
+    pEvdev->delta[ev->code] += ev->value;
+}
+
+/**
+ * Take the relative motion input event from a device with wheel emulation
+ * enabled and process it accordingly.
+ */
+static void
+EvdevProcessWheelEmuMotionEvent(InputInfoPtr pInfo, struct input_event *ev)
+{
+    EvdevPtr pEvdev = pInfo->private;
 
-    if (ev->code > ABS_MAX)
+    pEvdev->rel = 1;
+
+    /* Handle mouse wheel emulation */
+    if (EvdevWheelEmuFilterMotion(pInfo, ev))
+    {
+        EvdevRingMark(pEvdev, EV_RING_SWALLOWED);
         return;
+    }
 
-    pEvdev->vals[pEvdev->axis_map[ev->code]] = value;
-    if (ev->code == ABS_X)
-        pEvdev->abs |= ABS_X_VALUE;
-    else if (ev->code == ABS_Y)
-        pEvdev->abs |= ABS_Y_VALUE;
-    else
-        pEvdev->abs |= ABS_VALUE;
+    pEvdev->delta[ev->code] += ev->value;
 }
 
 /**
- * Take the key press/release input event and process it accordingly.
+ * Take the absolute motion input event and process it accordingly.
  */
 static void
-EvdevProcessKeyEvent(InputInfoPtr pInfo, struct input_event *ev)
+EvdevProcessAbsoluteMotionEvent(InputInfoPtr pInfo, struct input_event *ev)
 {
-    static int value;
     EvdevPtr pEvdev = pInfo->private;
 
-    /* Get the signed value, earlier kernels had this as unsigned */
-    value = ev->value;
+    pEvdev->vals[pEvdev->axis_map[ev->code]] = ev->value;
+    pEvdev->abs |= ABS_VALUE;
+}
 
-    /* don't repeat mouse buttons */
-    if (ev->code >= BTN_MOUSE && ev->code < KEY_OK)
-        if (value == 2)
-            return;
+static void
+EvdevProcessAbsXEvent(InputInfoPtr pInfo, struct input_event *ev)
+{
+    EvdevPtr pEvdev = pInfo->private;
 
-    switch (ev->code) {
-        case BTN_TOOL_PEN:
-        case BTN_TOOL_RUBBER:
-        case BTN_TOOL_BRUSH:
-        case BTN_TOOL_PENCIL:
-        case BTN_TOOL_AIRBRUSH:
-        case BTN_TOOL_FINGER:
-        case BTN_TOOL_MOUSE:
-        case BTN_TOOL_LENS:
-            pEvdev->tool = value ? ev->code : 0;
-            break;
+    pEvdev->vals[pEvdev->axis_map[ABS_X]] = ev->value;
+    pEvdev->abs |= ABS_X_VALUE;
+}
 
-        case BTN_TOUCH:
-            pEvdev->tool = value ? ev->code : 0;
-            if (!(pEvdev->flags & (EVDEV_TOUCHSCREEN | EVDEV_TABLET)))
-                break;
-            /* Treat BTN_TOUCH from devices that only have BTN_TOUCH as
-             * BTN_LEFT. */
-            ev->code = BTN_LEFT;
-            /* Intentional fallthrough! */
+static void
+EvdevProcessAbsYEvent(InputInfoPtr pInfo, struct input_event *ev)
+{
+    EvdevPtr pEvdev = pInfo->private;
 
-        default:
-            EvdevProcessButtonEvent(pInfo, ev);
-            break;
-    }
+    pEvdev->vals[pEvdev->axis_map[ABS_Y]] = ev->value;
+    pEvdev->abs |= ABS_Y_VALUE;
 }
 
 /**
@@ -680,6 +1006,8 @@ EvdevPostRelativeMotionEvents(InputInfoPtr pInfo, int *num_v, int *first_v,
 
     if (pEvdev->rel) {
         xf86PostMotionEventP(pInfo->dev, FALSE, *first_v, *num_v, v + *first_v);
+        if (pEvdev->tap.header)
+            EvdevTapMotion(pEvdev, EVDEV_TAP_REL, *first_v, *num_v, v + *first_v);
     }
 }
 
@@ -702,7 +1030,11 @@ EvdevPostAbsoluteMotionEvents(InputInfoPtr pInfo, int *num_v, int *first_v,
      * just works.
      */
     if (pEvdev->abs && pEvdev->tool)
+    {
         xf86PostMotionEventP(pInfo->dev, TRUE, *first_v, *num_v, v);
+        if (pEvdev->tap.header)
+            EvdevTapMotion(pEvdev, EVDEV_TAP_ABS, *first_v, *num_v, v);
+    }
 }
 
 /**
@@ -719,6 +1051,9 @@ static void EvdevPostQueuedEvents(InputInfoPtr pInfo, int *num_v, int *first_v,
         case EV_QUEUE_KEY:
             xf86PostKeyboardEvent(pInfo->dev, pEvdev->queue[i].key,
                                   pEvdev->queue[i].val);
+            if (pEvdev->tap.header)
+                EvdevTapWrite(pEvdev, EVDEV_TAP_KEY, 0, pEvdev->queue[i].key,
+                              pEvdev->queue[i].val);
             break;
         case EV_QUEUE_BTN:
             /* FIXME: Add xf86PostButtonEventP to the X server so that we may
@@ -726,11 +1061,123 @@ static void EvdevPostQueuedEvents(InputInfoPtr pInfo, int *num_v, int *first_v,
              * only MotionNotify events contain the pointer position. */
             xf86PostButtonEvent(pInfo->dev, 0, pEvdev->queue[i].key,
                                 pEvdev->queue[i].val, 0, 0);
+            if (pEvdev->tap.header)
+                EvdevTapWrite(pEvdev, EVDEV_TAP_BUTTON, 0, pEvdev->queue[i].key,
+                              pEvdev->queue[i].val);
             break;
         }
     }
 }
 
+/**
+ * Post the motion held back by EvdevCoalesceMotion().
+ */
+static void
+EvdevCoalesceFlush(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    int first = pEvdev->held.first;
+    int num = pEvdev->held.num;
+    int *v = pEvdev->held.v;
+
+    switch (pEvdev->coalesce.pending)
+    {
+        case EV_COALESCE_REL:
+            xf86PostMotionEventP(pInfo->dev, FALSE, first, num, v + first);
+            if (pEvdev->tap.header)
+                EvdevTapMotion(pEvdev, EVDEV_TAP_REL, first, num, v + first);
+            break;
+        case EV_COALESCE_ABS:
+            xf86PostMotionEventP(pInfo->dev, TRUE, first, num, v);
+            if (pEvdev->tap.header)
+                EvdevTapMotion(pEvdev, EVDEV_TAP_ABS, first, num, v);
+            break;
+    }
+
+    pEvdev->coalesce.pending = EV_COALESCE_NONE;
+}
+
+/**
+ * While the driver is behind, hold back the motion of frames without key
+ * or button events and merge it into the following frames: relative
+ * motion is summed up, absolute motion is replaced by the latest
+ * position. Key and button events are never held back, and the motion
+ * before them is posted first.
+ *
+ * The driver can't see the server's event queue, it is behind if the last
+ * read filled the buffer or the frame is more than EVDEV_COALESCE_AGE ms
+ * old. With DeferMotion, the motion is always held back until
+ * EvdevSchedBlockHandler() posts it.
+ *
+ * @return TRUE if the motion of this frame was held back.
+ */
+static BOOL
+EvdevCoalesceMotion(InputInfoPtr pInfo, struct input_event *ev,
+                    int v[MAX_VALUATORS], int *num_v, int *first_v)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    int *p = pEvdev->held.v;
+    struct timeval now;
+    long age;
+    int kind, i, lo, hi;
+
+    if (pEvdev->rel && *num_v > 0)
+        kind = EV_COALESCE_REL;
+    else if (pEvdev->abs && pEvdev->tool)
+        kind = EV_COALESCE_ABS;
+    else
+    {
+        if (pEvdev->num_queue)
+            EvdevCoalesceFlush(pInfo);
+        return FALSE;
+    }
+
+    if (pEvdev->coalesce.pending != kind)
+        EvdevCoalesceFlush(pInfo);
+    else if (kind == EV_COALESCE_REL)
+    {
+        lo = min(*first_v, pEvdev->held.first);
+        hi = max(*first_v + *num_v,
+                 pEvdev->held.first + pEvdev->held.num);
+        for (i = lo; i < hi; i++)
+        {
+            int cur = (i >= *first_v && i < *first_v + *num_v) ? v[i] : 0;
+            int old = (i >= pEvdev->held.first &&
+                       i < pEvdev->held.first + pEvdev->held.num) ?
+                      p[i] : 0;
+            v[i] = cur + old;
+        }
+        *first_v = lo;
+        *num_v = hi - lo;
+    }
+    /* absolute: this frame has the latest position already */
+
+    pEvdev->coalesce.pending = EV_COALESCE_NONE;
+
+    gettimeofday(&now, NULL);
+    age = (now.tv_sec - ev->time.tv_sec) * 1000 +
+          (now.tv_usec - ev->time.tv_usec) / 1000;
+
+    if (pEvdev->num_queue ||
+        (!pEvdev->sched.enabled && !pEvdev->coalesce.backlog &&
+         age <= EVDEV_COALESCE_AGE))
+        return FALSE;
+
+    pEvdev->held.first = *first_v;
+    pEvdev->held.num = *num_v;
+    if (kind == EV_COALESCE_REL)
+        memcpy(p + *first_v, v + *first_v, *num_v * sizeof(int));
+    else
+        memcpy(p, v, *num_v * sizeof(int));
+    pEvdev->coalesce.pending = kind;
+
+    /* keep the post functions from posting it */
+    pEvdev->rel = 0;
+    pEvdev->abs = 0;
+
+    return TRUE;
+}
+
 /**
  * Take the synchronization input event and process it accordingly; the motion
  * notify events are sent first, then any button/key press/release events.
@@ -741,18 +1188,161 @@ EvdevProcessSyncEvent(InputInfoPtr pInfo, struct input_event *ev)
     int num_v = 0, first_v = 0;
     int v[MAX_VALUATORS];
     EvdevPtr pEvdev = pInfo->private;
+    long long frame = 0, post = 0, cpu = 0;
+
+    EvdevTraceBegin(pEvdev, frame);
 
     EvdevProcessValuators(pInfo, v, &num_v, &first_v);
 
+    EVDEV_PROBE3(syn_report, pInfo->name, num_v, pEvdev->num_queue);
+
+    if ((pEvdev->coalesce.enabled || pEvdev->sched.enabled) &&
+        EvdevCoalesceMotion(pInfo, ev, v, &num_v, &first_v))
+        EvdevRingMark(pEvdev, EV_RING_COALESCED);
+    else
+        EvdevRingMark(pEvdev, EV_RING_POSTED);
+
+    EvdevTraceBegin(pEvdev, post);
+    if (pEvdev->cpu.sampling)
+        cpu = EvdevCpuNow();
     EvdevPostRelativeMotionEvents(pInfo, &num_v, &first_v, v);
     EvdevPostAbsoluteMotionEvents(pInfo, &num_v, &first_v, v);
     EvdevPostQueuedEvents(pInfo, &num_v, &first_v, v);
+    if (pEvdev->cpu.sampling)
+        pEvdev->cpu.post += EvdevCpuNow() - cpu;
+    EvdevTraceEnd(pInfo, pEvdev, EV_TRACE_POST, post);
 
     memset(pEvdev->delta, 0, sizeof(pEvdev->delta));
     memset(pEvdev->queue, 0, sizeof(pEvdev->queue));
     pEvdev->num_queue = 0;
     pEvdev->abs = 0;
     pEvdev->rel = 0;
+
+    EvdevTraceEnd(pInfo, pEvdev, EV_TRACE_FRAME, frame);
+}
+
+/**
+ * Take the synchronization input event from a device without axes and post
+ * the queued key/button events.
+ */
+static void
+EvdevProcessKbdSyncEvent(InputInfoPtr pInfo, struct input_event *ev)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    long long post = 0, cpu = 0;
+
+    EVDEV_PROBE3(syn_report, pInfo->name, 0, pEvdev->num_queue);
+    EvdevRingMark(pEvdev, EV_RING_POSTED);
+
+    EvdevTraceBegin(pEvdev, post);
+    if (pEvdev->cpu.sampling)
+        cpu = EvdevCpuNow();
+    EvdevPostQueuedEvents(pInfo, NULL, NULL, NULL);
+    if (pEvdev->cpu.sampling)
+        pEvdev->cpu.post += EvdevCpuNow() - cpu;
+    EvdevTraceEnd(pInfo, pEvdev, EV_TRACE_POST, post);
+    pEvdev->num_queue = 0;
+}
+
+/* Indices into evdev_procs, stored per event code in the EvdevRec. */
+enum {
+    EVDEV_PROC_IGNORE = 0,
+    EVDEV_PROC_KEY,
+    EVDEV_PROC_BUTTON,
+    EVDEV_PROC_PLAIN_BUTTON,
+    EVDEV_PROC_TOOL,
+    EVDEV_PROC_TOUCH,
+    EVDEV_PROC_WHEEL,
+    EVDEV_PROC_HWHEEL,
+    EVDEV_PROC_REL,
+    EVDEV_PROC_WHEELEMU_REL,
+    EVDEV_PROC_ABS,
+    EVDEV_PROC_ABS_X,
+    EVDEV_PROC_ABS_Y,
+    EVDEV_PROC_SYNC,
+    EVDEV_PROC_KBD_SYNC,
+};
+
+static void (*const evdev_procs[])(InputInfoPtr, struct input_event *) = {
+    [EVDEV_PROC_IGNORE]         = EvdevIgnoreEvent,
+    [EVDEV_PROC_KEY]            = EvdevProcessKeyEvent,
+    [EVDEV_PROC_BUTTON]         = EvdevProcessButtonEvent,
+    [EVDEV_PROC_PLAIN_BUTTON]   = EvdevProcessPlainButtonEvent,
+    [EVDEV_PROC_TOOL]           = EvdevProcessToolEvent,
+    [EVDEV_PROC_TOUCH]          = EvdevProcessTouchEvent,
+    [EVDEV_PROC_WHEEL]          = EvdevProcessWheelEvent,
+    [EVDEV_PROC_HWHEEL]         = EvdevProcessHWheelEvent,
+    [EVDEV_PROC_REL]            = EvdevProcessRelativeMotionEvent,
+    [EVDEV_PROC_WHEELEMU_REL]   = EvdevProcessWheelEmuMotionEvent,
+    [EVDEV_PROC_ABS]            = EvdevProcessAbsoluteMotionEvent,
+    [EVDEV_PROC_ABS_X]          = EvdevProcessAbsXEvent,
+    [EVDEV_PROC_ABS_Y]          = EvdevProcessAbsYEvent,
+    [EVDEV_PROC_SYNC]           = EvdevProcessSyncEvent,
+    [EVDEV_PROC_KBD_SYNC]       = EvdevProcessKbdSyncEvent,
+};
+
+/**
+ * Select the handler for each event code this device may send. Must be
+ * called again whenever the device type or the emulation settings change.
+ */
+void
+EvdevInitDispatch(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    BOOL emulation;
+    int i;
+
+    /* Any of drag lock, wheel or middle button emulation active? */
+    emulation = pEvdev->dragLock.meta ||
+                pEvdev->emulateWheel.enabled ||
+                pEvdev->emulateMB.enabled;
+    for (i = 0; i < pEvdev->num_buttons && !emulation; i++)
+        emulation = pEvdev->dragLock.lock_pair[i] != 0;
+
+    for (i = 0; i < KEY_CNT; i++) {
+        if (i >= BTN_TOOL_PEN && i <= BTN_TOOL_LENS)
+            pEvdev->key_proc[i] = EVDEV_PROC_TOOL;
+        else if (i == BTN_TOUCH)
+            pEvdev->key_proc[i] =
+                (pEvdev->flags & (EVDEV_TOUCHSCREEN | EVDEV_TABLET)) ?
+                EVDEV_PROC_TOUCH : EVDEV_PROC_TOOL;
+        else if (EvdevUtilButtonEventToButtonNumber(pEvdev, i))
+            pEvdev->key_proc[i] = emulation ? EVDEV_PROC_BUTTON :
+                                              EVDEV_PROC_PLAIN_BUTTON;
+        else
+            pEvdev->key_proc[i] = EVDEV_PROC_KEY;
+    }
+
+    for (i = 0; i < REL_CNT; i++) {
+        if (i == REL_WHEEL)
+            pEvdev->rel_proc[i] = EVDEV_PROC_WHEEL;
+        else if (i == REL_HWHEEL || i == REL_DIAL)
+            pEvdev->rel_proc[i] = EVDEV_PROC_HWHEEL;
+        /* Ignore EV_REL events if we never set up for them. */
+        else if (!(pEvdev->flags & EVDEV_RELATIVE_EVENTS))
+            pEvdev->rel_proc[i] = EVDEV_PROC_IGNORE;
+        else if (pEvdev->emulateWheel.enabled)
+            pEvdev->rel_proc[i] = EVDEV_PROC_WHEELEMU_REL;
+        else
+            pEvdev->rel_proc[i] = EVDEV_PROC_REL;
+    }
+
+    for (i = 0; i < ABS_CNT; i++) {
+        /* Ignore EV_ABS events if we never set up for them. */
+        if (!(pEvdev->flags & EVDEV_ABSOLUTE_EVENTS) ||
+            i >= pEvdev->num_axis_codes || pEvdev->axis_map[i] == -1)
+            pEvdev->abs_proc[i] = EVDEV_PROC_IGNORE;
+        else if (i == ABS_X)
+            pEvdev->abs_proc[i] = EVDEV_PROC_ABS_X;
+        else if (i == ABS_Y)
+            pEvdev->abs_proc[i] = EVDEV_PROC_ABS_Y;
+        else
+            pEvdev->abs_proc[i] = EVDEV_PROC_ABS;
+    }
+
+    pEvdev->syn_proc =
+        (pEvdev->flags & (EVDEV_RELATIVE_EVENTS | EVDEV_ABSOLUTE_EVENTS)) ?
+        EVDEV_PROC_SYNC : EVDEV_PROC_KBD_SYNC;
 }
 
 /**
@@ -762,18 +1352,32 @@ EvdevProcessSyncEvent(InputInfoPtr pInfo, struct input_event *ev)
 static void
 EvdevProcessEvent(InputInfoPtr pInfo, struct input_event *ev)
 {
+    EvdevPtr pEvdev = pInfo->private;
+
+    EVDEV_PROBE4(event, pInfo->name, ev->type, ev->code, ev->value);
+    EvdevRingPush(pEvdev, ev);
+
+    if (pEvdev->tap.header)
+    {
+        pEvdev->tap.time = ev->time;
+        EvdevTapWrite(pEvdev, EVDEV_TAP_RAW, ev->type, ev->code, ev->value);
+    }
+
     switch (ev->type) {
         case EV_REL:
-            EvdevProcessRelativeMotionEvent(pInfo, ev);
+            if (ev->code <= REL_MAX)
+                evdev_procs[pEvdev->rel_proc[ev->code]](pInfo, ev);
             break;
         case EV_ABS:
-            EvdevProcessAbsoluteMotionEvent(pInfo, ev);
+            if (ev->code <= ABS_MAX)
+                evdev_procs[pEvdev->abs_proc[ev->code]](pInfo, ev);
             break;
         case EV_KEY:
-            EvdevProcessKeyEvent(pInfo, ev);
+            if (ev->code <= KEY_MAX)
+                evdev_procs[pEvdev->key_proc[ev->code]](pInfo, ev);
             break;
         case EV_SYN:
-            EvdevProcessSyncEvent(pInfo, ev);
+            evdev_procs[pEvdev->syn_proc](pInfo, ev);
             break;
     }
 }
@@ -791,46 +1395,310 @@ EvdevReadInput(InputInfoPtr pInfo)
     struct input_event ev[NUM_EVENTS];
     int i, len = sizeof(ev);
     EvdevPtr pEvdev = pInfo->private;
+    long long t = 0;
+    long long cpu = 0, cpu_read = 0, cpu_process = 0;
+    int budget = EVDEV_READ_BUDGET;
+    BOOL sample;
+
+    EvdevTraceBegin(pEvdev, t);
+
+    pEvdev->sched.more = FALSE;
+
+    if (pEvdev->group.phys[0] && !pEvdev->group.direct)
+    {
+        EvdevGroupRead(pInfo);
+        EvdevTraceEnd(pInfo, pEvdev, EV_TRACE_READ, t);
+        return;
+    }
+
+    sample = !(pEvdev->cpu.reads++ & (EVDEV_CPU_SAMPLE - 1));
+    pEvdev->cpu.sampling = sample;
 
     while (len == sizeof(ev))
     {
-        len = read(pInfo->fd, &ev, sizeof(ev));
+        if (pEvdev->sched.enabled && budget <= 0)
+        {
+            /* leave the rest for EvdevSchedBlockHandler() */
+            pEvdev->sched.more = TRUE;
+            break;
+        }
+
+        EVDEV_PROBE1(read_start, pInfo->fd);
+        if (sample)
+            cpu = EvdevCpuNow();
+        len = evdev_backend->sys_read(pInfo->fd, &ev, sizeof(ev));
+        if (sample)
+        {
+            cpu_read -= cpu;
+            cpu = EvdevCpuNow();
+            cpu_read += cpu;
+        }
+        EVDEV_PROBE2(read_end, pInfo->fd, len);
         if (len <= 0)
         {
             if (errno == ENODEV) /* May happen after resume */
             {
                 EvdevMBEmuFinalize(pInfo);
                 xf86RemoveEnabledDevice(pInfo);
-                close(pInfo->fd);
+                evdev_backend->sys_close(pInfo->fd);
                 pInfo->fd = -1;
                 if (pEvdev->reopen_timer)
-                {
-                    pEvdev->reopen_left = pEvdev->reopen_attempts;
-                    pEvdev->reopen_timer = TimerSet(pEvdev->reopen_timer, 0, 100, EvdevReopenTimer, pInfo);
-                }
+                    EvdevReopenStart(pInfo);
             } else if (errno != EAGAIN)
-            {
-                /* We use X_NONE here because it doesn't alloc */
-                xf86MsgVerb(X_NONE, 0, "%s: Read error: %s\n", pInfo->name,
-                        strerror(errno));
-            }
+                EvdevLog(pInfo, EVDEV_LOG_READ_ERROR, errno);
             break;
         }
 
         /* The kernel promises that we always only read a complete
          * event, so len != sizeof ev is an error. */
         if (len % sizeof(ev[0])) {
-            /* We use X_NONE here because it doesn't alloc */
-            xf86MsgVerb(X_NONE, 0, "%s: Read error: %s\n", pInfo->name, strerror(errno));
+            EvdevLog(pInfo, EVDEV_LOG_READ_ERROR, errno);
             break;
         }
 
+        if (pEvdev->record.fd != -1)
+            EvdevRecordEvents(pInfo, ev, len/sizeof(ev[0]));
+
+        /* more events are waiting in the kernel */
+        pEvdev->coalesce.backlog = (len == sizeof(ev));
+
         for (i = 0; i < len/sizeof(ev[0]); i++)
             EvdevProcessEvent(pInfo, &ev[i]);
+        budget -= len/sizeof(ev[0]);
+
+        if (sample)
+            cpu_process += EvdevCpuNow() - cpu;
+    }
+
+    /* read dry, post what's left */
+    if (pEvdev->coalesce.pending && !pEvdev->sched.enabled)
+        EvdevCoalesceFlush(pInfo);
+
+    if (sample)
+    {
+        EvdevCpuAccount(pInfo, cpu_read, cpu_process);
+        pEvdev->cpu.sampling = FALSE;
     }
+
+    EvdevTraceEnd(pInfo, pEvdev, EV_TRACE_READ, t);
+}
+
+/**
+ * @return The index of the EV_SYN/SYN_REPORT that ends the frame starting
+ * at pos, or count if the frame is not complete.
+ */
+static int
+EvdevGroupFrameEnd(struct input_event *ev, int pos, int count)
+{
+    while (pos < count &&
+           !(ev[pos].type == EV_SYN && ev[pos].code == SYN_REPORT))
+        pos++;
+
+    return pos;
+}
+
+/**
+ * GroupByPhys: read the device together with its siblings, the devices
+ * with the same group key, and process their frames in the order of their
+ * kernel timestamps. Up to EVDEV_GROUP_SIZE devices are read, up to
+ * EVDEV_READ_BUDGET events each per round. What's left on a device with
+ * DeferMotion is read from its EvdevSchedBlockHandler(), the other devices
+ * are read until they are dry. Frames that aren't complete yet are
+ * processed last, their EV_SYN only comes with the next read. Each
+ * device's reads are sampled for CPU accounting and traced as in
+ * EvdevReadInput().
+ */
+static void
+EvdevGroupRead(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    EvdevPtr *dev;
+    InputInfoPtr members[EVDEV_GROUP_SIZE];
+    struct input_event ev[EVDEV_GROUP_SIZE][EVDEV_READ_BUDGET];
+    int count[EVDEV_GROUP_SIZE], pos[EVDEV_GROUP_SIZE], end[EVDEV_GROUP_SIZE];
+    long long cpu = 0;
+    long long cpu_read[EVDEV_GROUP_SIZE], cpu_process[EVDEV_GROUP_SIZE];
+    BOOL sample[EVDEV_GROUP_SIZE];
+    BOOL again[EVDEV_GROUP_SIZE];   /* member's buffer was full, read more */
+    int i, j, len, next, num = 0;
+    BOOL full;
+
+    members[num++] = pInfo;
+    for (dev = evdev_devices; *dev && num < EVDEV_GROUP_SIZE; dev++)
+    {
+        InputInfoPtr sibling = (*dev)->group.pInfo;
+
+        if (*dev != pEvdev && sibling && sibling->fd != -1 &&
+            sibling->dev && sibling->dev->public.on &&
+            !strcmp((*dev)->group.phys, pEvdev->group.phys))
+            members[num++] = sibling;
+    }
+
+    for (i = 0; i < num; i++)
+    {
+        EvdevPtr m = members[i]->private;
+
+        sample[i] = !(m->cpu.reads++ & (EVDEV_CPU_SAMPLE - 1));
+        m->cpu.sampling = sample[i];
+        cpu_read[i] = cpu_process[i] = 0;
+        again[i] = TRUE;
+    }
+
+    do {
+        full = FALSE;
+
+        for (i = 0; i < num; i++)
+        {
+            EvdevPtr m = members[i]->private;
+
+            count[i] = pos[i] = 0;
+            if (!again[i])
+                continue;
+            again[i] = FALSE;
+            m->sched.more = FALSE;
+            if (members[i]->fd == -1)
+                continue;
+
+            EVDEV_PROBE1(read_start, members[i]->fd);
+            if (sample[i])
+                cpu = EvdevCpuNow();
+            len = evdev_backend->sys_read(members[i]->fd, ev[i], sizeof(ev[i]));
+            if (sample[i])
+                cpu_read[i] += EvdevCpuNow() - cpu;
+            EVDEV_PROBE2(read_end, members[i]->fd, len);
+            if (len <= 0 || len % sizeof(ev[i][0]))
+            {
+                /* let the plain read path deal with the error */
+                if (len == 0 || errno != EAGAIN)
+                {
+                    m->group.direct = TRUE;
+                    EvdevReadInput(members[i]);
+                    m->group.direct = FALSE;
+                    m->cpu.sampling = sample[i];
+                }
+                continue;
+            }
+
+            count[i] = len / sizeof(ev[i][0]);
+            if (m->record.fd != -1)
+                EvdevRecordEvents(members[i], ev[i], count[i]);
+
+            m->coalesce.backlog = (count[i] == EVDEV_READ_BUDGET);
+            if (m->coalesce.backlog)
+            {
+                /* with DeferMotion the block handler reads the rest, the
+                 * other members are drained here */
+                if (m->sched.enabled)
+                    m->sched.more = TRUE;
+                else
+                    again[i] = full = TRUE;
+            }
+        }
+
+        for (i = 0; i < num; i++)
+            end[i] = EvdevGroupFrameEnd(ev[i], 0, count[i]);
+
+        /* the complete frames, oldest first */
+        for (;;)
+        {
+            next = -1;
+            for (i = 0; i < num; i++)
+            {
+                if (end[i] == count[i])
+                    continue;
+                if (next == -1 ||
+                    timercmp(&ev[i][end[i]].time, &ev[next][end[next]].time, <))
+                    next = i;
+            }
+            if (next == -1)
+                break;
+
+            if (sample[next])
+                cpu = EvdevCpuNow();
+            for (j = pos[next]; j <= end[next]; j++)
+                EvdevProcessEvent(members[next], &ev[next][j]);
+            if (sample[next])
+                cpu_process[next] += EvdevCpuNow() - cpu;
+            pos[next] = end[next] + 1;
+            end[next] = EvdevGroupFrameEnd(ev[next], pos[next], count[next]);
+        }
+
+        for (i = 0; i < num; i++)
+        {
+            if (sample[i])
+                cpu = EvdevCpuNow();
+            for (j = pos[i]; j < count[i]; j++)
+                EvdevProcessEvent(members[i], &ev[i][j]);
+            if (sample[i])
+                cpu_process[i] += EvdevCpuNow() - cpu;
+        }
+    } while (full);
+
+    for (i = 0; i < num; i++)
+    {
+        EvdevPtr m = members[i]->private;
+
+        if (m->coalesce.pending && !m->sched.enabled)
+            EvdevCoalesceFlush(members[i]);
+
+        if (sample[i])
+        {
+            EvdevCpuAccount(members[i], cpu_read[i], cpu_process[i]);
+            m->cpu.sampling = FALSE;
+        }
+    }
+}
+
+/**
+ * DeferMotion: post the motion held back by EvdevCoalesceMotion(), then
+ * read another EVDEV_READ_BUDGET events if the budget ran out.
+ *
+ * Block handlers run after the server has read all devices with pending
+ * input from its wakeup handler and processed their events. So the key
+ * and button events of all devices read in one wakeup are processed
+ * before any motion-only frame, at the cost of one more round of the main
+ * loop for the motion. A device flooding events only gets its budget's
+ * worth in per wakeup, the rest is read here after all devices were read.
+ */
+static void
+EvdevSchedBlockHandler(pointer data, struct timeval **waitTime,
+                       pointer LastSelectMask)
+{
+    InputInfoPtr pInfo = (InputInfoPtr)data;
+    EvdevPtr pEvdev = pInfo->private;
+    BOOL posted = FALSE;
+    int block;
+
+    if (!pInfo->dev->public.on)
+        return;
+
+    block = xf86BlockSIGIO();
+    if (pEvdev->coalesce.pending)
+    {
+        EvdevCoalesceFlush(pInfo);
+        posted = TRUE;
+    }
+    if (pEvdev->sched.more && pInfo->fd != -1)
+    {
+        EvdevReadInput(pInfo);
+        if (pEvdev->coalesce.pending)
+            EvdevCoalesceFlush(pInfo);
+        posted = TRUE;
+    }
+    xf86UnblockSIGIO(block);
+
+    /* don't sleep on what was just posted or on unread events */
+    if (posted || pEvdev->sched.more)
+        AdjustWaitForDelay(waitTime, 0);
+}
+
+static void
+EvdevSchedWakeupHandler(pointer data, int i, pointer LastSelectMask)
+{
 }
 
 #define TestBit(bit, array) ((array[(bit) / LONG_BITS]) & (1L << ((bit) % LONG_BITS)))
+#define SetBit(bit, array) ((array[(bit) / LONG_BITS]) |= (1L << ((bit) % LONG_BITS)))
 
 static void
 EvdevPtrCtrlProc(DeviceIntPtr device, PtrCtrl *ctrl)
@@ -1173,8 +2041,44 @@ EvdevKbdCtrl(DeviceIntPtr device, KeybdCtrl *ctrl)
         ev[i].value = (ctrl->leds & bits[i].xbit) > 0;
     }
 
-    write(pInfo->fd, ev, sizeof ev);
+    evdev_backend->sys_write(pInfo->fd, ev, sizeof ev);
+}
+
+#if GET_ABI_MAJOR(ABI_XINPUT_VERSION) >= 5
+static BOOL
+EvdevXkbStrEqual(const char *a, const char *b)
+{
+    if (!a || !b)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+/**
+ * Return TRUE if the given RMLVO matches the server's XKB rules defaults.
+ *
+ * InitKeyboardDeviceStruct() stores the RMLVO of the last keymap it
+ * compiled as the new defaults and keeps that keymap around, so a match
+ * means the compiled keymap can be shared instead of running xkbcomp again.
+ * This is the common case of a keyboard split into several evdev nodes
+ * (keys, consumer control, hotkeys, power button).
+ */
+static BOOL
+EvdevKeymapIsCached(XkbRMLVOSet *rmlvo)
+{
+    XkbRMLVOSet dflts = { NULL };
+    BOOL match;
+
+    XkbGetRulesDflts(&dflts);
+    match = EvdevXkbStrEqual(rmlvo->rules, dflts.rules) &&
+            EvdevXkbStrEqual(rmlvo->model, dflts.model) &&
+            EvdevXkbStrEqual(rmlvo->layout, dflts.layout) &&
+            EvdevXkbStrEqual(rmlvo->variant, dflts.variant) &&
+            EvdevXkbStrEqual(rmlvo->options, dflts.options);
+    XkbFreeRMLVOSet(&dflts, FALSE);
+
+    return match;
 }
+#endif
 
 static int
 EvdevAddKeyClass(DeviceIntPtr device)
@@ -1202,7 +2106,12 @@ EvdevAddKeyClass(DeviceIntPtr device)
         SetXkbOption(pInfo, "XkbOptions", &pEvdev->rmlvo.options);
 
 #if GET_ABI_MAJOR(ABI_XINPUT_VERSION) >= 5
-    if (!InitKeyboardDeviceStruct(device, &pEvdev->rmlvo, NULL, EvdevKbdCtrl))
+    /* A NULL RMLVO makes the server reuse the keymap it compiled for its
+     * current defaults, so only pass ours if they differ. */
+    if (!InitKeyboardDeviceStruct(device,
+                                  EvdevKeymapIsCached(&pEvdev->rmlvo) ?
+                                  NULL : &pEvdev->rmlvo,
+                                  NULL, EvdevKbdCtrl))
         return !Success;
 #else
     if (!EvdevInitKeysyms(device))
@@ -1235,7 +2144,7 @@ EvdevAddAbsClass(DeviceIntPtr device)
     memset(pEvdev->old_vals, -1, num_axes * sizeof(int));
     atoms = malloc(pEvdev->num_vals * sizeof(Atom));
 
-    for (axis = ABS_X; axis <= ABS_MAX; axis++) {
+    for (axis = ABS_X; axis < pEvdev->num_axis_codes; axis++) {
         pEvdev->axis_map[axis] = -1;
         if (!TestBit(axis, pEvdev->abs_bitmask))
             continue;
@@ -1255,7 +2164,7 @@ EvdevAddAbsClass(DeviceIntPtr device)
                                        GetMotionHistorySize(), Absolute))
         return !Success;
 
-    for (axis = ABS_X; axis <= ABS_MAX; axis++) {
+    for (axis = ABS_X; axis < pEvdev->num_axis_codes; axis++) {
         int axnum = pEvdev->axis_map[axis];
         if (axnum == -1)
             continue;
@@ -1312,7 +2221,7 @@ EvdevAddRelClass(DeviceIntPtr device)
     memset(pEvdev->vals, 0, num_axes * sizeof(int));
     atoms = malloc(pEvdev->num_vals * sizeof(Atom));
 
-    for (axis = REL_X; axis <= REL_MAX; axis++)
+    for (axis = REL_X; axis <= REL_MAX && axis < pEvdev->num_axis_codes; axis++)
     {
         pEvdev->axis_map[axis] = -1;
         /* We don't post wheel events, so ignore them here too */
@@ -1336,7 +2245,7 @@ EvdevAddRelClass(DeviceIntPtr device)
                                        GetMotionHistorySize(), Relative))
         return !Success;
 
-    for (axis = REL_X; axis <= REL_MAX; axis++)
+    for (axis = REL_X; axis <= REL_MAX && axis < pEvdev->num_axis_codes; axis++)
     {
         int axnum = pEvdev->axis_map[axis];
 
@@ -1410,7 +2319,7 @@ EvdevInitButtonMapping(InputInfoPtr pInfo)
         int     btn = 0;
 
         xf86Msg(X_CONFIG, "%s: ButtonMapping '%s'\n", pInfo->name, mapping);
-        while (s && *s != '\0' && nbuttons < EVDEV_MAXBUTTONS)
+        while (s && *s != '\0' && nbuttons <= pEvdev->num_buttons)
         {
             btn = strtol(mapping, &s, 10);
 
@@ -1428,7 +2337,7 @@ EvdevInitButtonMapping(InputInfoPtr pInfo)
         }
     }
 
-    for (i = nbuttons; i < ArrayLength(pEvdev->btnmap); i++)
+    for (i = nbuttons; i <= pEvdev->num_buttons; i++)
         pEvdev->btnmap[i] = i;
 
 }
@@ -1508,16 +2417,21 @@ EvdevInit(DeviceIntPtr device)
     int i;
     InputInfoPtr pInfo;
     EvdevPtr pEvdev;
+    long long t = EvdevStartupNow();
 
     pInfo = device->public.devicePrivate;
     pEvdev = pInfo->private;
 
     /* clear all axis_map entries */
-    for(i = 0; i < max(ABS_CNT,REL_CNT); i++)
+    for(i = 0; i < pEvdev->num_axis_codes; i++)
       pEvdev->axis_map[i]=-1;
 
     if (pEvdev->flags & EVDEV_KEYBOARD_EVENTS)
+    {
+        EvdevStartupPhase(pEvdev, EV_STARTUP_CLASSES, &t);
 	EvdevAddKeyClass(device);
+        EvdevStartupPhase(pEvdev, EV_STARTUP_KEYMAP, &t);
+    }
     if (pEvdev->flags & EVDEV_BUTTON_EVENTS)
 	EvdevAddButtonClass(device);
 
@@ -1548,20 +2462,246 @@ EvdevInit(DeviceIntPtr device)
 #endif
         EvdevInitAbsClass(device, pEvdev);
 
+    EvdevStartupPhase(pEvdev, EV_STARTUP_CLASSES, &t);
+
 #ifdef HAVE_PROPERTIES
     /* We drop the return value, the only time we ever want the handlers to
      * unregister is when the device dies. In which case we don't have to
      * unregister anyway */
     EvdevInitProperty(device);
-    XIRegisterPropertyHandler(device, EvdevSetProperty, NULL, NULL);
+    XIRegisterPropertyHandler(device, EvdevSetProperty, EvdevGetProperty, NULL);
     EvdevMBEmuInitProperty(device);
     EvdevWheelEmuInitProperty(device);
     EvdevDragLockInitProperty(device);
+    EvdevRecordInitProperty(device);
+    EvdevTraceInitProperty(device);
+    EvdevCpuInitProperty(device);
+#endif
+
+    EvdevInitDispatch(pInfo);
+    EvdevLogInit(pInfo);
+    EvdevTapStart(pInfo);
+    if (pEvdev->sched.enabled)
+        RegisterBlockAndWakeupHandlers(EvdevSchedBlockHandler,
+                                       EvdevSchedWakeupHandler,
+                                       (pointer)pInfo);
+
+    EvdevStartupPhase(pEvdev, EV_STARTUP_PROPERTIES, &t);
+#ifdef HAVE_PROPERTIES
+    EvdevStartupInitProperty(device);
 #endif
 
     return Success;
 }
 
+/**
+ * Tell the kernel which events we process, so that it drops everything else
+ * instead of queuing it for us to read and discard:
+ * - EV_KEY codes that map to a button, a tool or a keycode the server
+ *   can handle. Key repeats cannot be masked, they are per value.
+ * - EV_REL wheels, other EV_REL axes only if we set up relative axes.
+ * - EV_ABS axes only if we set up absolute axes for them.
+ * EV_MSC, EV_LED, EV_SW and the others are never processed.
+ *
+ * If mute is TRUE, all events are masked. Used to switch the device off
+ * without closing it. Kernels without EVIOCSMASK keep queuing events, these
+ * are flushed when the device is switched back on.
+ *
+ * @return FALSE if the device has gone away, TRUE otherwise.
+ */
+static BOOL
+EvdevSetEventMask(InputInfoPtr pInfo, BOOL mute)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    unsigned long types[NLONGS(EV_CNT)] = {0};
+    unsigned long keys[NLONGS(KEY_CNT)] = {0};
+    unsigned long rels[NLONGS(REL_CNT)] = {0};
+    unsigned long abss[NLONGS(ABS_CNT)] = {0};
+    struct {
+        int type;
+        unsigned long *bits;
+        size_t size;
+    } masks[] = {
+        { EV_KEY, keys, sizeof(keys) },
+        { EV_REL, rels, sizeof(rels) },
+        { EV_ABS, abss, sizeof(abss) },
+        { EV_SYN, types, sizeof(types) }, /* EV_SYN is the type mask */
+    };
+    struct input_mask mask;
+    int i;
+
+    if (!mute)
+    {
+        SetBit(EV_SYN, types);
+
+        for (i = 0; i < KEY_CNT; i++) {
+            if (!TestBit(i, pEvdev->key_bitmask))
+                continue;
+            if (i + MIN_KEYCODE <= 255 ||
+                (i >= BTN_TOOL_PEN && i <= BTN_TOOL_LENS) || i == BTN_TOUCH ||
+                EvdevUtilButtonEventToButtonNumber(pEvdev, i))
+            {
+                SetBit(i, keys);
+                SetBit(EV_KEY, types);
+            }
+        }
+
+        for (i = 0; i < REL_CNT; i++) {
+            if (!TestBit(i, pEvdev->rel_bitmask))
+                continue;
+            if (i == REL_WHEEL || i == REL_HWHEEL || i == REL_DIAL ||
+                (pEvdev->flags & EVDEV_RELATIVE_EVENTS))
+            {
+                SetBit(i, rels);
+                SetBit(EV_REL, types);
+            }
+        }
+
+        if (pEvdev->flags & EVDEV_ABSOLUTE_EVENTS) {
+            for (i = 0; i < pEvdev->num_axis_codes; i++) {
+                if (TestBit(i, pEvdev->abs_bitmask) &&
+                    pEvdev->axis_map[i] != -1)
+                {
+                    SetBit(i, abss);
+                    SetBit(EV_ABS, types);
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < ArrayLength(masks); i++) {
+        /* When muting, the type mask alone is enough */
+        if (mute && masks[i].type != EV_SYN)
+            continue;
+
+        mask.type = masks[i].type;
+        mask.codes_size = masks[i].size;
+        mask.codes_ptr = (unsigned long)masks[i].bits;
+
+        if (evdev_backend->sys_ioctl(pInfo->fd, EVIOCSMASK, &mask) == -1) {
+            if (errno == ENODEV)
+                return FALSE;
+            break; /* EINVAL, kernel doesn't support masks */
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * Release the keys and buttons the server still has down but the device
+ * doesn't, i.e. the ones let go of while the device was muted. Buttons
+ * are compared by button number, so emulated buttons that are down get
+ * released too.
+ */
+static void
+EvdevReleaseKeys(InputInfoPtr pInfo, unsigned long *key_state)
+{
+    DeviceIntPtr dev = pInfo->dev;
+    EvdevPtr pEvdev = pInfo->private;
+    CARD8 held[32] = {0};   /* buttons physically down */
+    int i, button, code;
+
+    for (i = 0; i < KEY_CNT; i++)
+    {
+        if (!TestBit(i, pEvdev->key_bitmask))
+            continue;
+
+        button = EvdevUtilButtonEventToButtonNumber(pEvdev, i);
+        if (button)
+        {
+            if (TestBit(i, key_state) && button < 256)
+                held[button >> 3] |= 1 << (button & 7);
+            continue;
+        }
+
+        code = i + MIN_KEYCODE;
+        if (dev->key && code <= 255 && !TestBit(i, key_state) &&
+            (dev->key->down[code >> 3] & (1 << (code & 7))))
+        {
+            xf86PostKeyboardEvent(dev, code, 0);
+            if (pEvdev->tap.header)
+                EvdevTapWrite(pEvdev, EVDEV_TAP_KEY, 0, code, 0);
+        }
+    }
+
+    if (!dev->button)
+        return;
+
+    for (button = 1; button <= pEvdev->num_buttons && button < 256; button++)
+    {
+        if ((dev->button->down[button >> 3] & (1 << (button & 7))) &&
+            !(held[button >> 3] & (1 << (button & 7))))
+            EvdevPostButtonEvent(pInfo, button, 0);
+    }
+}
+
+/**
+ * Bring our state up to date after the device was muted. Anything the
+ * kernel still queued is dropped, the button emulations start over, keys
+ * and buttons released in the meantime are released, the absolute axes
+ * and the tool in proximity are re-read since they may have changed too.
+ */
+static void
+EvdevResync(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    unsigned long key_state[NLONGS(KEY_CNT)] = {0};
+    struct input_absinfo absinfo;
+    BOOL have_keys;
+    int i;
+
+    evdev_backend->sys_flush(pInfo->fd);
+
+    memset(pEvdev->delta, 0, sizeof(pEvdev->delta));
+    pEvdev->num_queue = 0;
+    pEvdev->abs = 0;
+    pEvdev->rel = 0;
+
+    pEvdev->emulateMB.pending = FALSE;
+    pEvdev->emulateMB.buttonstate = 0;
+    pEvdev->emulateMB.state = 0;
+    pEvdev->emulateWheel.button_state = 0;
+    pEvdev->emulateWheel.X.traveled_distance = 0;
+    pEvdev->emulateWheel.Y.traveled_distance = 0;
+
+    have_keys = (evdev_backend->sys_ioctl(pInfo->fd,
+                                          EVIOCGKEY(sizeof(key_state)),
+                                          key_state) >= 0);
+    if (have_keys)
+        EvdevReleaseKeys(pInfo, key_state);
+
+    if (!(pEvdev->flags & EVDEV_ABSOLUTE_EVENTS))
+        return;
+
+    for (i = ABS_X; i < pEvdev->num_axis_codes; i++) {
+        int map = pEvdev->axis_map[i];
+
+        if (map == -1)
+            continue;
+        if (evdev_backend->sys_ioctl(pInfo->fd, EVIOCGABS(i), &absinfo) == 0)
+            pEvdev->vals[map] = absinfo.value;
+    }
+    pEvdev->old_vals[0] = pEvdev->old_vals[1] = -1;
+
+    if (!have_keys)
+        return;
+
+    for (i = BTN_TOOL_PEN; i <= BTN_TOUCH; i++) {
+        if (!TestBit(i, pEvdev->key_bitmask))
+            continue;
+        /* device uses proximity, see EvdevProcessKeyEvent */
+        pEvdev->tool = 0;
+        break;
+    }
+    for (i = BTN_TOOL_PEN; i <= BTN_TOUCH; i++) {
+        if (TestBit(i, pEvdev->key_bitmask) && TestBit(i, key_state)) {
+            pEvdev->tool = i;
+            break;
+        }
+    }
+}
+
 /**
  * Init all extras (wheel emulation, etc.) and grab the device.
  *
@@ -1578,8 +2718,29 @@ EvdevOn(DeviceIntPtr device)
     pInfo = device->public.devicePrivate;
     pEvdev = pInfo->private;
 
+    /* Switched off with SoftOff, fd and grab are still in place */
+    if (pEvdev->flags & EVDEV_MUTED)
+    {
+        pEvdev->flags &= ~EVDEV_MUTED;
+
+        if (EvdevSetEventMask(pInfo, FALSE))
+        {
+            pEvdev->reopen_timer = TimerSet(pEvdev->reopen_timer, 0, 0, NULL, NULL);
+            EvdevResync(pInfo);
+            xf86AddEnabledDevice(pInfo);
+            EvdevMBEmuOn(pInfo);
+            pEvdev->flags |= EVDEV_INITIALIZED;
+            device->public.on = TRUE;
+            return Success;
+        }
+
+        /* device has disappeared while it was off */
+        evdev_backend->sys_close(pInfo->fd);
+        pInfo->fd = -1;
+    }
+
     if (pInfo->fd != -1 && pEvdev->grabDevice &&
-        (rc = ioctl(pInfo->fd, EVIOCGRAB, (void *)1)))
+        (rc = evdev_backend->sys_ioctl(pInfo->fd, EVIOCGRAB, (void *)1)))
     {
         xf86Msg(X_WARNING, "%s: Grab failed (%s)\n", pInfo->name,
                 strerror(errno));
@@ -1587,15 +2748,14 @@ EvdevOn(DeviceIntPtr device)
         /* ENODEV - device has disappeared after resume */
         if (rc && errno == ENODEV)
         {
-            close(pInfo->fd);
+            evdev_backend->sys_close(pInfo->fd);
             pInfo->fd = -1;
         }
     }
 
     if (pInfo->fd == -1)
     {
-        pEvdev->reopen_left = pEvdev->reopen_attempts;
-        pEvdev->reopen_timer = TimerSet(pEvdev->reopen_timer, 0, 100, EvdevReopenTimer, pInfo);
+        EvdevReopenStart(pInfo);
     } else
     {
         pEvdev->min_maj = EvdevGetMajorMinor(pInfo);
@@ -1608,7 +2768,8 @@ EvdevOn(DeviceIntPtr device)
 
         pEvdev->reopen_timer = TimerSet(pEvdev->reopen_timer, 0, 0, NULL, NULL);
 
-        xf86FlushInput(pInfo->fd);
+        EvdevSetEventMask(pInfo, FALSE);
+        evdev_backend->sys_flush(pInfo->fd);
         xf86AddEnabledDevice(pInfo);
         EvdevMBEmuOn(pInfo);
         pEvdev->flags |= EVDEV_INITIALIZED;
@@ -1625,6 +2786,8 @@ EvdevProc(DeviceIntPtr device, int what)
     InputInfoPtr pInfo;
     EvdevPtr pEvdev;
     int region[4] = { 0, };
+    long long t;
+    int rc;
 
     pInfo = device->public.devicePrivate;
     pEvdev = pInfo->private;
@@ -1635,24 +2798,43 @@ EvdevProc(DeviceIntPtr device, int what)
 	return EvdevInit(device);
 
     case DEVICE_ON:
-        return EvdevOn(device);
+        t = EvdevStartupNow();
+        rc = EvdevOn(device);
+        if (!pEvdev->startup.reported)
+        {
+            EvdevStartupPhase(pEvdev, EV_STARTUP_ON, &t);
+            EvdevStartupReport(pInfo);
+        }
+        return rc;
 
     case DEVICE_OFF:
         if (pEvdev->flags & EVDEV_INITIALIZED)
             EvdevMBEmuFinalize(pInfo);
 
-        if (pInfo->fd != -1)
+        if (pInfo->fd != -1 && pEvdev->soft_off)
+        {
+            /* keep fd and grab, we only stop listening */
+            xf86RemoveEnabledDevice(pInfo);
+            if (EvdevSetEventMask(pInfo, TRUE))
+                pEvdev->flags |= EVDEV_MUTED;
+        }
+
+        if (pInfo->fd != -1 && !(pEvdev->flags & EVDEV_MUTED))
         {
-            if (pEvdev->grabDevice && ioctl(pInfo->fd, EVIOCGRAB, (void *)0))
+            if (pEvdev->grabDevice && evdev_backend->sys_ioctl(pInfo->fd, EVIOCGRAB, (void *)0))
                 xf86Msg(X_WARNING, "%s: Release failed (%s)\n", pInfo->name,
                         strerror(errno));
             xf86RemoveEnabledDevice(pInfo);
-            close(pInfo->fd);
+            evdev_backend->sys_close(pInfo->fd);
             pInfo->fd = -1;
         }
-        pEvdev->min_maj = 0;
+        if (!(pEvdev->flags & EVDEV_MUTED))
+            pEvdev->min_maj = 0;
         pEvdev->flags &= ~EVDEV_INITIALIZED;
 	device->public.on = FALSE;
+        pEvdev->coalesce.pending = EV_COALESCE_NONE;
+        pEvdev->sched.more = FALSE;
+        EvdevReopenStop(pInfo);
         if (pEvdev->reopen_timer)
         {
             TimerFree(pEvdev->reopen_timer);
@@ -1667,9 +2849,18 @@ EvdevProc(DeviceIntPtr device, int what)
 #endif//_F_EVDEV_CONFINE_REGION_
 	xf86Msg(X_INFO, "%s: Close\n", pInfo->name);
         if (pInfo->fd != -1) {
-            close(pInfo->fd);
+            evdev_backend->sys_close(pInfo->fd);
             pInfo->fd = -1;
         }
+        pEvdev->flags &= ~EVDEV_MUTED;
+        EvdevRecordStop(pInfo);
+        EvdevTraceStop(pInfo);
+        EvdevLogClose(pInfo);
+        EvdevTapStop(pInfo);
+        if (pEvdev->sched.enabled)
+            RemoveBlockAndWakeupHandlers(EvdevSchedBlockHandler,
+                                         EvdevSchedWakeupHandler,
+                                         (pointer)pInfo);
         EvdevRemoveDevice(pInfo);
         pEvdev->min_maj = 0;
 	break;
@@ -1700,7 +2891,7 @@ EvdevCacheCompare(InputInfoPtr pInfo, BOOL compare)
     unsigned long abs_bitmask[NLONGS(ABS_CNT)] = {0};
     unsigned long led_bitmask[NLONGS(LED_CNT)] = {0};
 
-    if (ioctl(pInfo->fd, EVIOCGNAME(sizeof(name) - 1), name) < 0) {
+    if (evdev_backend->sys_ioctl(pInfo->fd, EVIOCGNAME(sizeof(name) - 1), name) < 0) {
         xf86Msg(X_ERROR, "ioctl EVIOCGNAME failed: %s\n", strerror(errno));
         goto error;
     }
@@ -1713,7 +2904,7 @@ EvdevCacheCompare(InputInfoPtr pInfo, BOOL compare)
         goto error;
     }
 
-    len = ioctl(pInfo->fd, EVIOCGBIT(0, sizeof(bitmask)), bitmask);
+    len = evdev_backend->sys_ioctl(pInfo->fd, EVIOCGBIT(0, sizeof(bitmask)), bitmask);
     if (len < 0) {
         xf86Msg(X_ERROR, "%s: ioctl EVIOCGBIT failed: %s\n",
                 pInfo->name, strerror(errno));
@@ -1727,7 +2918,7 @@ EvdevCacheCompare(InputInfoPtr pInfo, BOOL compare)
         goto error;
     }
 
-    len = ioctl(pInfo->fd, EVIOCGBIT(EV_REL, sizeof(rel_bitmask)), rel_bitmask);
+    len = evdev_backend->sys_ioctl(pInfo->fd, EVIOCGBIT(EV_REL, sizeof(rel_bitmask)), rel_bitmask);
     if (len < 0) {
         xf86Msg(X_ERROR, "%s: ioctl EVIOCGBIT failed: %s\n",
                 pInfo->name, strerror(errno));
@@ -1741,7 +2932,7 @@ EvdevCacheCompare(InputInfoPtr pInfo, BOOL compare)
         goto error;
     }
 
-    len = ioctl(pInfo->fd, EVIOCGBIT(EV_ABS, sizeof(abs_bitmask)), abs_bitmask);
+    len = evdev_backend->sys_ioctl(pInfo->fd, EVIOCGBIT(EV_ABS, sizeof(abs_bitmask)), abs_bitmask);
     if (len < 0) {
         xf86Msg(X_ERROR, "%s: ioctl EVIOCGBIT failed: %s\n",
                 pInfo->name, strerror(errno));
@@ -1755,7 +2946,7 @@ EvdevCacheCompare(InputInfoPtr pInfo, BOOL compare)
         goto error;
     }
 
-    len = ioctl(pInfo->fd, EVIOCGBIT(EV_LED, sizeof(led_bitmask)), led_bitmask);
+    len = evdev_backend->sys_ioctl(pInfo->fd, EVIOCGBIT(EV_LED, sizeof(led_bitmask)), led_bitmask);
     if (len < 0) {
         xf86Msg(X_ERROR, "%s: ioctl EVIOCGBIT failed: %s\n",
                 pInfo->name, strerror(errno));
@@ -1775,7 +2966,7 @@ EvdevCacheCompare(InputInfoPtr pInfo, BOOL compare)
      */
     for (i = ABS_X; i <= ABS_MAX; i++) {
         if (TestBit(i, abs_bitmask)) {
-            len = ioctl(pInfo->fd, EVIOCGABS(i), &pEvdev->absinfo[i]);
+            len = evdev_backend->sys_ioctl(pInfo->fd, EVIOCGABS(i), &pEvdev->absinfo[i]);
             if (len < 0) {
                 xf86Msg(X_ERROR, "%s: ioctl EVIOCGABSi(%d) failed: %s\n",
                         pInfo->name, i, strerror(errno));
@@ -1784,7 +2975,7 @@ EvdevCacheCompare(InputInfoPtr pInfo, BOOL compare)
         }
     }
 
-    len = ioctl(pInfo->fd, EVIOCGBIT(EV_KEY, sizeof(key_bitmask)), key_bitmask);
+    len = evdev_backend->sys_ioctl(pInfo->fd, EVIOCGBIT(EV_KEY, sizeof(key_bitmask)), key_bitmask);
     if (len < 0) {
         xf86Msg(X_ERROR, "%s: ioctl EVIOCGBIT failed: %s\n",
                 pInfo->name, strerror(errno));
@@ -1830,7 +3021,9 @@ EvdevProbe(InputInfoPtr pInfo)
     int ignore_abs = 0, ignore_rel = 0;
     EvdevPtr pEvdev = pInfo->private;
 
-    if (pEvdev->grabDevice && ioctl(pInfo->fd, EVIOCGRAB, (void *)1)) {
+    EvdevInitButtonCodeMap(pInfo);
+
+    if (pEvdev->grabDevice && evdev_backend->sys_ioctl(pInfo->fd, EVIOCGRAB, (void *)1)) {
         if (errno == EINVAL) {
             /* keyboards are unsafe in 2.4 */
             kernel24 = 1;
@@ -1840,7 +3033,7 @@ EvdevProbe(InputInfoPtr pInfo)
             return 1;
         }
     } else if (pEvdev->grabDevice) {
-        ioctl(pInfo->fd, EVIOCGRAB, (void *)0);
+        evdev_backend->sys_ioctl(pInfo->fd, EVIOCGRAB, (void *)0);
     }
 
     /* Trinary state for ignoring axes:
@@ -1957,7 +3150,6 @@ EvdevProbe(InputInfoPtr pInfo)
                 if (num_buttons || TestBit(BTN_TOOL_FINGER, pEvdev->key_bitmask)) {
                     xf86Msg(X_INFO, "%s: Found absolute touchpad.\n", pInfo->name);
                     pEvdev->flags |= EVDEV_TOUCHPAD;
-                    memset(pEvdev->old_vals, -1, sizeof(int) * pEvdev->num_vals);
                 } else {
                     xf86Msg(X_INFO, "%s: Found absolute touchscreen\n", pInfo->name);
                     pEvdev->flags |= EVDEV_TOUCHSCREEN;
@@ -2238,6 +3430,56 @@ EvdevSetConfineRegion(InputInfoPtr pInfo, int num_item, int region[5])
 }
 #endif /* _F_EVDEV_CONFINE_REGION_ */
 
+/**
+ * Allocate the arrays whose size depends on the device's buttons and axes:
+ * axis_map, vals/old_vals, the drag lock state and btnmap. They share one
+ * block, which lives as long as the EvdevRec. Must be called after
+ * EvdevProbe() and once num_buttons is final.
+ */
+static int
+EvdevAllocState(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    int num_codes = 0, num_vals, num_rel, nbuttons, i;
+    char *block;
+
+    for (i = ABS_MAX; i >= 0 && !num_codes; i--)
+        if (TestBit(i, pEvdev->abs_bitmask))
+            num_codes = i + 1;
+    for (i = REL_MAX; i >= num_codes; i--)
+        if (TestBit(i, pEvdev->rel_bitmask)) {
+            num_codes = i + 1;
+            break;
+        }
+
+    /* touchpads always use the first two, see EvdevProcessValuators */
+    num_vals = EvdevCountBits(pEvdev->abs_bitmask, NLONGS(ABS_CNT));
+    num_rel = EvdevCountBits(pEvdev->rel_bitmask, NLONGS(REL_CNT));
+    num_vals = max(max(num_vals, num_rel), 2);
+
+    nbuttons = pEvdev->num_buttons;
+
+    block = calloc(1, num_codes * sizeof(int) +
+                      2 * num_vals * sizeof(int) +
+                      nbuttons * (sizeof(unsigned int) + sizeof(BOOL)) +
+                      (nbuttons + 1) * sizeof(unsigned char));
+    if (!block)
+        return !Success;
+
+    pEvdev->num_axis_codes = num_codes;
+    pEvdev->axis_map = (int*)block;
+    pEvdev->vals = pEvdev->axis_map + num_codes;
+    pEvdev->old_vals = pEvdev->vals + num_vals;
+    pEvdev->dragLock.lock_pair = (unsigned int*)(pEvdev->old_vals + num_vals);
+    pEvdev->dragLock.lock_state = (BOOL*)(pEvdev->dragLock.lock_pair + nbuttons);
+    pEvdev->btnmap = (unsigned char*)(pEvdev->dragLock.lock_state + nbuttons);
+
+    for (i = 0; i < num_codes; i++)
+        pEvdev->axis_map[i] = -1;
+
+    return Success;
+}
+
 static int
 EvdevPreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
 {
@@ -2246,6 +3488,7 @@ EvdevPreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
     int num_calibration = 0, calibration[4] = { 0, 0, 0, 0 };
     int num_resolution = 0, resolution[4] = { 0, 0, 0, 0 };
     EvdevPtr pEvdev;
+    long long t = EvdevStartupNow();
 
 	if(!pInfo)
 	{
@@ -2274,6 +3517,7 @@ EvdevPreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
      * proximity will still report events.
      */
     pEvdev->tool = 1;
+    pEvdev->reopen_watch = -1;
 
     device = xf86CheckStrOption(pInfo->options, "Device", NULL);
     if (!device) {
@@ -2286,9 +3530,11 @@ EvdevPreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
     pEvdev->device = device;
 
     xf86Msg(X_CONFIG, "%s: Device: \"%s\"\n", pInfo->name, device);
+    EvdevStartupPhase(pEvdev, EV_STARTUP_PREINIT, &t);
     do {
-        pInfo->fd = open(device, O_RDWR | O_NONBLOCK, 0);
+        pInfo->fd = evdev_backend->sys_open(device, O_RDWR | O_NONBLOCK);
     } while (pInfo->fd < 0 && errno == EINTR);
+    EvdevStartupPhase(pEvdev, EV_STARTUP_OPEN, &t);
 
     if (pInfo->fd < 0) {
         xf86Msg(X_ERROR, "Unable to open evdev device \"%s\".\n", device);
@@ -2303,7 +3549,7 @@ EvdevPreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
     {
         xf86Msg(X_WARNING, "%s: device file already in use. Ignoring.\n",
                 pInfo->name);
-        close(pInfo->fd);
+        evdev_backend->sys_close(pInfo->fd);
         xf86DeleteInput(pInfo, 0);
         rc = BadValue;
         goto error;
@@ -2345,11 +3591,41 @@ EvdevPreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
        Note that this needs a server that sets the console to RAW mode. */
     pEvdev->grabDevice = xf86CheckBoolOption(pInfo->options, "GrabDevice", 0);
 
-    EvdevInitButtonMapping(pInfo);
+    /* Keep the device open and grabbed while it is switched off. */
+    pEvdev->soft_off = xf86SetBoolOption(pInfo->options, "SoftOff", FALSE);
+
+    /* Let clients feed events through the driver, for load testing. */
+    pEvdev->inject = xf86SetBoolOption(pInfo->options, "InjectEvents", FALSE);
+
+    /* Merge motion frames while the driver is behind. */
+    pEvdev->coalesce.enabled = xf86SetBoolOption(pInfo->options,
+                                                 "MotionCoalescing", FALSE);
+
+    /* Post key and button events of all devices before motion. */
+    pEvdev->sched.enabled = xf86SetBoolOption(pInfo->options, "DeferMotion",
+                                              FALSE);
+
+    /* Read the nodes of one physical device together. */
+    if (xf86SetBoolOption(pInfo->options, "GroupByPhys", FALSE))
+        EvdevGroupPreInit(pInfo);
+
+    EvdevRecordPreInit(pInfo);
+    EvdevTracePreInit(pInfo);
+    EvdevCpuPreInit(pInfo);
+    EvdevLogPreInit(pInfo);
+    EvdevTapPreInit(pInfo);
 
-    if (EvdevCacheCompare(pInfo, FALSE) ||
-        EvdevProbe(pInfo)) {
-	close(pInfo->fd);
+    EvdevStartupPhase(pEvdev, EV_STARTUP_PREINIT, &t);
+    rc = EvdevCacheCompare(pInfo, FALSE);
+    EvdevStartupPhase(pEvdev, EV_STARTUP_CACHE, &t);
+    if (rc == Success)
+    {
+        rc = EvdevProbe(pInfo);
+        EvdevStartupPhase(pEvdev, EV_STARTUP_PROBE, &t);
+    }
+
+    if (rc != Success) {
+	evdev_backend->sys_close(pInfo->fd);
 	xf86DeleteInput(pInfo, 0);
        rc = BadMatch;
        goto error;
@@ -2375,25 +3651,57 @@ EvdevPreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
     {
         EvdevMBEmuPreInit(pInfo);
         EvdevWheelEmuPreInit(pInfo);
-        EvdevDragLockPreInit(pInfo);
     }
 
+    /* Wheel emulation may have added buttons, size the arrays now */
+    if (EvdevAllocState(pInfo) != Success) {
+        xf86Msg(X_ERROR, "%s: Failed to allocate device state\n", pInfo->name);
+        EvdevRemoveDevice(pInfo);
+        rc = BadAlloc;
+        goto error;
+    }
+
+    EvdevInitButtonMapping(pInfo);
+
+    if (pEvdev->flags & EVDEV_BUTTON_EVENTS)
+        EvdevDragLockPreInit(pInfo);
+
     memset(&pEvdev->pointer_confine_region, 0, sizeof(pEvdev->pointer_confine_region));
 
+    EvdevStartupPhase(pEvdev, EV_STARTUP_PREINIT, &t);
+
     return Success;
 
 error:
     if (pInfo->fd >= 0)
-        close(pInfo->fd);
+        evdev_backend->sys_close(pInfo->fd);
     return rc;
 }
 
+static void
+EvdevUnInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
+{
+    EvdevPtr pEvdev = pInfo ? pInfo->private : NULL;
+
+    if (pEvdev)
+    {
+        /* Release the option strings kept past EvdevPreInit. */
+        free(pEvdev->record.path);
+        pEvdev->record.path = NULL;
+        free(pEvdev->trace.path);
+        pEvdev->trace.path = NULL;
+        free(pEvdev->tap_path);
+        pEvdev->tap_path = NULL;
+    }
+    xf86DeleteInput(pInfo, flags);
+}
+
 _X_EXPORT InputDriverRec EVDEV = {
     1,
     "evdev",
     NULL,
     EvdevPreInit,
-    NULL,
+    EvdevUnInit,
     NULL,
     0
 };
@@ -2409,6 +3717,12 @@ EvdevPlug(pointer	module,
           int		*errmaj,
           int		*errmin)
 {
+#ifdef ENABLE_MOCK_BACKEND
+    const char *mock = getenv("EVDEV_MOCK");
+
+    if (mock)
+        evdev_backend = EvdevMockBackend(mock);
+#endif
     xf86AddInputDriver(&EVDEV, module, 0);
     return module;
 }
@@ -2441,70 +3755,72 @@ _X_EXPORT XF86ModuleData evdevModuleData =
 unsigned int
 EvdevUtilButtonEventToButtonNumber(EvdevPtr pEvdev, int code)
 {
-    unsigned int button = 0;
+    if (code < BTN_MISC || code >= BTN_JOYSTICK)
+        return 0;
 
-    switch(code) {
-    case BTN_LEFT:
-	button = 1;
-	break;
+    return pEvdev->btn_code_map[code - BTN_MISC];
+}
 
-    case BTN_RIGHT:
-	button = 3;
-	break;
+/**
+ * Fill the code to button number table from the device's key bitmask. Must
+ * be called before anything calls EvdevUtilButtonEventToButtonNumber() and
+ * again if the key bitmask changes.
+ *
+ * BTN_LEFT, BTN_MIDDLE and BTN_RIGHT are buttons 1, 2 and 3; BTN_SIDE and up
+ * start at button 8, after the wheel buttons.
+ * BTN_[0-2] are treated as LMR buttons on devices that do not advertise
+ * BTN_LEFT, BTN_MIDDLE, BTN_RIGHT, otherwise they are buttons 8-10.
+ * BTN_[3-9] are buttons 8-14. These collide with each other and with
+ * BTN_SIDE + n, so a BTN_[0-9] the device has is moved to the next button
+ * number not used by any of its other buttons.
+ */
+static void
+EvdevInitButtonCodeMap(InputInfoPtr pInfo)
+{
+    static const int lmr[] = { BTN_LEFT, BTN_MIDDLE, BTN_RIGHT };
+    EvdevPtr pEvdev = pInfo->private;
+    BOOL used[EVDEV_MAXBUTTONS + 1] = {0};
+    int code, button;
 
-    case BTN_MIDDLE:
-	button = 2;
-	break;
+    for (code = BTN_MOUSE; code < BTN_JOYSTICK; code++)
+    {
+        switch (code) {
+        case BTN_LEFT:   button = 1; break;
+        case BTN_MIDDLE: button = 2; break;
+        case BTN_RIGHT:  button = 3; break;
+        default:         button = code - BTN_LEFT + 5; break;
+        }
 
-        /* Treat BTN_[0-2] as LMR buttons on devices that do not advertise
-           BTN_LEFT, BTN_MIDDLE, BTN_RIGHT.
-           Otherwise, treat BTN_[0+n] as button 5+n.
-           XXX: This causes duplicate mappings for BTN_0 + n and BTN_SIDE + n
-         */
-    case BTN_0:
-        button = (TestBit(BTN_LEFT, pEvdev->key_bitmask)) ?  8 : 1;
-        break;
-    case BTN_1:
-        button = (TestBit(BTN_MIDDLE, pEvdev->key_bitmask)) ?  9 : 2;
-        break;
-    case BTN_2:
-        button = (TestBit(BTN_RIGHT, pEvdev->key_bitmask)) ?  10 : 3;
-        break;
+        if (button > EVDEV_MAXBUTTONS)
+            button = 0;
+        else if (TestBit(code, pEvdev->key_bitmask))
+            used[button] = TRUE;
 
-        /* FIXME: BTN_3.. and BTN_SIDE.. have the same button mapping */
-    case BTN_3:
-    case BTN_4:
-    case BTN_5:
-    case BTN_6:
-    case BTN_7:
-    case BTN_8:
-    case BTN_9:
-	button = (code - BTN_0 + 5);
-        break;
+        pEvdev->btn_code_map[code - BTN_MISC] = button;
+    }
 
-    case BTN_SIDE:
-    case BTN_EXTRA:
-    case BTN_FORWARD:
-    case BTN_BACK:
-    case BTN_TASK:
-	button = (code - BTN_LEFT + 5);
-	break;
+    for (code = BTN_MISC; code < BTN_MOUSE; code++)
+    {
+        if (code - BTN_0 >= ArrayLength(lmr))
+            button = code - BTN_0 + 5;
+        else if (!TestBit(lmr[code - BTN_0], pEvdev->key_bitmask))
+            button = code - BTN_0 + 1;
+        else
+            button = code - BTN_0 + 8;
 
-    default:
-	if ((code > BTN_TASK) && (code < KEY_OK)) {
-	    if (code < BTN_JOYSTICK) {
-                if (code < BTN_MOUSE)
-                    button = (code - BTN_0 + 5);
-                else
-                    button = (code - BTN_LEFT + 5);
-            }
-	}
-    }
+        if (TestBit(code, pEvdev->key_bitmask))
+        {
+            while (button <= EVDEV_MAXBUTTONS && used[button])
+                button++;
+            if (button <= EVDEV_MAXBUTTONS)
+                used[button] = TRUE;
+        }
 
-    if (button > EVDEV_MAXBUTTONS)
-	return 0;
+        if (button > EVDEV_MAXBUTTONS)
+            button = 0;
 
-    return button;
+        pEvdev->btn_code_map[code - BTN_MISC] = button;
+    }
 }
 
 #ifdef HAVE_PROPERTIES
@@ -2668,7 +3984,7 @@ static void EvdevInitAxesLabels(EvdevPtr pEvdev, int natoms, Atom *atoms)
     memset(atoms, 0, natoms * sizeof(Atom));
 
     /* Now fill the ones we know */
-    for (axis = 0; axis < labels_len; axis++)
+    for (axis = 0; axis < labels_len && axis < pEvdev->num_axis_codes; axis++)
     {
         if (pEvdev->axis_map[axis] == -1)
             continue;
@@ -2709,6 +4025,8 @@ static void EvdevInitButtonLabels(EvdevPtr pEvdev, int natoms, Atom *atoms)
 
             /* Props are 0-indexed, button numbers start with 1 */
             bmap = EvdevUtilButtonEventToButtonNumber(pEvdev, button) - 1;
+            if (bmap < 0)
+                continue;
             atoms[bmap] = atom;
         }
     }
@@ -2748,6 +4066,18 @@ EvdevInitProperty(DeviceIntPtr dev)
 
     XISetDevicePropertyDeletable(dev, prop_reopen, FALSE);
 
+    if (pEvdev->inject)
+    {
+        prop_inject = MakeAtom(EVDEV_PROP_INJECT, strlen(EVDEV_PROP_INJECT),
+                               TRUE);
+        rc = XIChangeDeviceProperty(dev, prop_inject, XA_INTEGER, 32,
+                                    PropModeReplace, 0, NULL, FALSE);
+        if (rc != Success)
+            return;
+
+        XISetDevicePropertyDeletable(dev, prop_inject, FALSE);
+    }
+
     if (pEvdev->flags & (EVDEV_RELATIVE_EVENTS | EVDEV_ABSOLUTE_EVENTS))
     {
         invert[0] = pEvdev->invert_x;
@@ -2868,6 +4198,81 @@ EvdevSetResolution(InputInfoPtr pInfo, int num_resolution, int resolution[4])
     }
 }
 
+/**
+ * Check the events written to the injection property. The codes index the
+ * per-code tables, so they must be in range like the kernel's are.
+ */
+static int
+EvdevInjectCheck(CARD32 *data, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++, data += 3)
+    {
+        switch (data[0])
+        {
+            case EV_SYN: break;
+            case EV_KEY: if (data[1] > KEY_MAX) return BadValue; break;
+            case EV_REL: if (data[1] > REL_MAX) return BadValue; break;
+            case EV_ABS: if (data[1] > ABS_MAX) return BadValue; break;
+            default: return BadValue;
+        }
+    }
+
+    return Success;
+}
+
+/**
+ * Process the events written to the injection property as if they had
+ * been read from the device, all stamped with the current time.
+ */
+static void
+EvdevInjectEvents(InputInfoPtr pInfo, CARD32 *data, int count)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    struct input_event ev;
+    int i, block;
+
+    memset(&ev, 0, sizeof(ev));
+    gettimeofday(&ev.time, NULL);
+
+    block = xf86BlockSIGIO();
+    /* the last read's backlog says nothing about these frames */
+    pEvdev->coalesce.backlog = FALSE;
+    for (i = 0; i < count; i++, data += 3)
+    {
+        ev.type = data[0];
+        ev.code = data[1];
+        ev.value = (int)data[2];
+        EvdevProcessEvent(pInfo, &ev);
+    }
+    if (pEvdev->coalesce.pending)
+        EvdevCoalesceFlush(pInfo);
+    xf86UnblockSIGIO(block);
+}
+
+/**
+ * The injected events are not kept, a client reading "Evdev Inject Events"
+ * gets an empty value.
+ */
+static int
+EvdevGetProperty(DeviceIntPtr dev, Atom atom)
+{
+    InputInfoPtr pInfo  = dev->public.devicePrivate;
+    EvdevPtr     pEvdev = pInfo->private;
+    int          rc;
+
+    if (atom != prop_inject || !pEvdev->inject)
+        return Success;
+
+    inject_updating = TRUE;
+    rc = XIChangeDeviceProperty(dev, prop_inject, XA_INTEGER, 32,
+                                PropModeReplace, 0, NULL, FALSE);
+    inject_updating = FALSE;
+
+    return rc;
+}
+
 static int
 EvdevSetProperty(DeviceIntPtr dev, Atom atom, XIPropertyValuePtr val,
                  BOOL checkonly)
@@ -2911,6 +4316,24 @@ EvdevSetProperty(DeviceIntPtr dev, Atom atom, XIPropertyValuePtr val,
         if (!checkonly)
             pEvdev->swap_axes = *((BOOL*)val->data);
 	 EvdevSwapAxes(pEvdev);
+    } else if (atom == prop_inject)
+    {
+        /* the atom is shared, only the devices with InjectEvents take it */
+        if (!pEvdev->inject)
+            return BadAccess;
+        if (inject_updating)
+            return Success;
+        if (val->format != 32 || val->type != XA_INTEGER || val->size % 3)
+            return BadMatch;
+
+        if (checkonly)
+        {
+            if (!dev->public.on)
+                return BadAccess;
+            return EvdevInjectCheck(val->data, val->size / 3);
+        }
+
+        EvdevInjectEvents(pInfo, val->data, val->size / 3);
     } else if (atom == prop_axis_label || atom == prop_btn_label)
         return BadAccess; /* Axis/Button labels can't be changed */
 #ifdef _F_EVDEV_CONFINE_REGION_
@@ -33,11 +33,15 @@
 
 #include <linux/input.h>
 #include <linux/types.h>
+#include <stddef.h>
+#include <sys/stat.h>
 
 #include <xf86Xinput.h>
 #include <xf86_OSproc.h>
 #include <xkbstr.h>
 
+#include "evdev-record.h"
+
 #ifndef EV_CNT /* linux 2.4 kernels and earlier lack _CNT defines */
 #define EV_CNT (EV_MAX+1)
 #endif
@@ -54,8 +58,20 @@
 #define LED_CNT (LED_MAX+1)
 #endif
 
-#define EVDEV_MAXBUTTONS 32
+/* Highest button number, buttons are CARD8 in the protocol. The per-device
+ * arrays are sized to num_buttons, see EvdevAllocState() */
+#define EVDEV_MAXBUTTONS 255
 #define EVDEV_MAXQUEUE 32
+#define EVDEV_HOT_SIZE 320 /* per-event bytes of EvdevRec, 5 cache lines */
+#define EVDEV_RING_SIZE 128 /* flight recorder entries, power of two */
+#define EVDEV_TRACE_SPANS 1024 /* trace spans buffered between writes */
+#define EVDEV_RECORD_EVENTS 4096 /* recorded events buffered between writes */
+#define EVDEV_CPU_SAMPLE 8 /* CPU time is measured for one in this many reads */
+#define EVDEV_LOG_SIZE 16 /* queued log messages, power of two */
+#define EVDEV_TAP_SIZE 4096 /* TapFile entries, power of two */
+#define EVDEV_COALESCE_AGE 20 /* ms, older frames mean the driver is behind */
+#define EVDEV_READ_BUDGET 64 /* events read per wakeup with DeferMotion */
+#define EVDEV_GROUP_SIZE 4 /* GroupByPhys siblings read together */
 
 #if GET_ABI_MAJOR(ABI_XINPUT_VERSION) >= 3
 #define HAVE_PROPERTIES 1
@@ -89,6 +105,85 @@ typedef struct {
     int traveled_distance;
 } WheelAxis, *WheelAxisPtr;
 
+/* What the driver did with an event, for the flight recorder. */
+enum {
+    EV_RING_SEEN = 0,       /* accumulated for the next EV_SYN */
+    EV_RING_IGNORED,        /* not set up for this code */
+    EV_RING_SWALLOWED,      /* eaten by drag lock or an emulation */
+    EV_RING_QUEUED,         /* key/button queued for EV_SYN */
+    EV_RING_DROPPED,        /* queue was full */
+    EV_RING_POSTED,         /* EV_SYN, the frame was posted */
+    EV_RING_COALESCED,      /* EV_SYN, motion held back, see MotionCoalescing */
+};
+
+/* Motion held back by MotionCoalescing */
+enum {
+    EV_COALESCE_NONE = 0,
+    EV_COALESCE_REL,
+    EV_COALESCE_ABS,
+};
+
+typedef struct {
+    struct input_event  ev;
+    int                 decision;   /* EV_RING_* */
+} EvdevRingEntry;
+
+/* Span types for the TraceFile, see timeline.c */
+enum {
+    EV_TRACE_READ = 0,      /* EvdevReadInput */
+    EV_TRACE_FRAME,         /* EV_SYN processing */
+    EV_TRACE_POST,          /* posting the frame to the server */
+    EV_TRACE_MBEMU,         /* middle button emulation timer */
+    EV_TRACE_REOPEN,        /* reopen attempt */
+};
+
+/* Messages from the input path, see log.c */
+enum {
+    EVDEV_LOG_QUEUE_FULL = 0,
+    EVDEV_LOG_READ_ERROR,       /* arg is errno */
+    EVDEV_LOG_KEYCODE,          /* arg is the key code */
+    EVDEV_LOG_COUNT
+};
+
+typedef struct {
+    int                 id;         /* EVDEV_LOG_* */
+    int                 arg;
+    unsigned int        suppressed; /* rate limited since the last one */
+} EvdevLogEntry;
+
+typedef struct {
+    unsigned int        tokens;
+    CARD32              last;       /* ms, last refill */
+    unsigned int        suppressed;
+} EvdevLogBucket;
+
+/* Startup phases, in order, see startup.c */
+enum {
+    EV_STARTUP_OPEN = 0,    /* open() of the device node */
+    EV_STARTUP_CACHE,       /* EvdevCacheCompare's ioctls */
+    EV_STARTUP_PROBE,       /* EvdevProbe, including the test grab */
+    EV_STARTUP_PREINIT,     /* the rest of EvdevPreInit */
+    EV_STARTUP_KEYMAP,      /* EvdevAddKeyClass, compiling the keymap */
+    EV_STARTUP_CLASSES,     /* the rest of EvdevInit */
+    EV_STARTUP_PROPERTIES,  /* creating the properties */
+    EV_STARTUP_ON,          /* the first EvdevOn */
+    EV_STARTUP_PHASES
+};
+
+/* Stages of EvdevReadInput for CPU accounting, see cpu.c */
+enum {
+    EV_CPU_READ = 0,        /* read() from the device */
+    EV_CPU_PROCESS,         /* EvdevProcessEvent, except posting */
+    EV_CPU_POST,            /* posting frames to the server */
+    EV_CPU_STAGES
+};
+
+typedef struct {
+    long long           start;      /* us */
+    long long           dur;        /* us */
+    int                 type;       /* EV_TRACE_* */
+} EvdevTraceSpanRec;
+
 /* Event queue used to defer keyboard/button events until EV_SYN time. */
 typedef struct {
     enum {
@@ -100,29 +195,75 @@ typedef struct {
 } EventQueueRec, *EventQueuePtr;
 
 typedef struct {
-    const char *device;
-    int grabDevice;         /* grab the event device? */
-
-    int num_vals;           /* number of valuators */
-    int axis_map[max(ABS_CNT, REL_CNT)]; /* Map evdev <axis> to index */
-    int vals[MAX_VALUATORS];
-    int old_vals[MAX_VALUATORS]; /* Translate absolute inputs to relative */
-
+    /* Per-event state, read or written for every event or EV_SYN. Keep it
+     * together at the start of the struct, ending with ring, within
+     * EVDEV_HOT_SIZE bytes; configuration and cached device info go after
+     * it. */
     int flags;
     int tool;
-    int num_buttons;            /* number of buttons */
+    unsigned int abs, rel;
+    int num_vals;           /* number of valuators */
+    int *axis_map;          /* Map evdev <axis> to index */
+    int *vals;
+    int *old_vals;          /* Translate absolute inputs to relative */
     BOOL swap_axes;
     BOOL invert_x;
     BOOL invert_y;
 
+    /* Event queue used to defer keyboard/button events until EV_SYN time. */
+    int                     num_queue;
+    unsigned char           syn_proc;
+
     int delta[REL_CNT];
-    unsigned int abs, rel;
 
-    /* XKB stuff has to be per-device rather than per-driver */
-#if GET_ABI_MAJOR(ABI_XINPUT_VERSION) < 5
-    XkbComponentNamesRec    xkbnames;
-#endif
-    XkbRMLVOSet rmlvo;
+    /* run-time calibration */
+    struct {
+        int                 min_x;
+        int                 max_x;
+        int                 min_y;
+        int                 max_y;
+    } calibration;
+
+    /* Event handler for each event code, see EvdevInitDispatch() */
+    unsigned char           rel_proc[REL_CNT];
+    unsigned char           abs_proc[ABS_CNT];
+
+    /* CPU accounting of the current read, see cpu.c */
+    struct {
+        unsigned int        reads;      /* counts reads to pick samples */
+        BOOL                sampling;   /* this read is being measured */
+        long long           post;       /* ns spent posting in this read */
+    } cpu;
+
+    /* MotionCoalescing, see EvdevCoalesceMotion() */
+    struct {
+        BOOL                enabled;
+        BOOL                backlog;    /* the last read filled the buffer */
+        int                 pending;    /* EV_COALESCE_*, valuators in held */
+    } coalesce;
+
+    /* DeferMotion, see EvdevSchedBlockHandler() */
+    struct {
+        BOOL                enabled;
+        BOOL                more;       /* the read budget ran out */
+    } sched;
+
+    /* Events published to the TapFile, see tap.c */
+    struct {
+        pointer             header;     /* mapped file, NULL if none */
+        unsigned int        head;       /* number of the next entry */
+        struct timeval      time;       /* of the last event read */
+    } tap;
+
+    /* Flight recorder position, the entries are at the end */
+    struct {
+        unsigned int        head;       /* next slot to write */
+        EvdevRingEntry      *cur;       /* entry of the event in progress */
+    } ring;
+
+    /* End of the per-event state. The queue follows it, a frame only uses
+     * the first num_queue slots. */
+    EventQueueRec           queue[EVDEV_MAXQUEUE];
 
     /* Middle mouse button emulation */
     struct {
@@ -136,8 +277,8 @@ typedef struct {
     struct {
 	int                 meta;           /* meta key to lock any button */
 	BOOL                meta_state;     /* meta_button state */
-	unsigned int        lock_pair[EVDEV_MAXBUTTONS];  /* specify a meta/lock pair */
-	BOOL                lock_state[EVDEV_MAXBUTTONS]; /* state of any locked buttons */
+	unsigned int        *lock_pair;     /* specify a meta/lock pair */
+	BOOL                *lock_state;    /* state of any locked buttons */
     } dragLock;
     struct {
         BOOL                enabled;
@@ -149,13 +290,39 @@ typedef struct {
         Time                expires;     /* time of expiry */
         Time                timeout;
     } emulateWheel;
-    /* run-time calibration */
+
+    /* Only one entry of these is read per key or button event */
+    unsigned char           key_proc[KEY_CNT];
+    /* button number for BTN_MISC..BTN_JOYSTICK-1, 0 if not a button */
+    unsigned char           btn_code_map[BTN_JOYSTICK - BTN_MISC];
+
+    const char *device;
+    int grabDevice;         /* grab the event device? */
+    BOOL soft_off;          /* keep fd open while switched off? */
+    BOOL inject;            /* "Evdev Inject Events" allowed? */
+
+    /* Motion held back by EvdevCoalesceMotion(), see coalesce */
     struct {
-        int                 min_x;
-        int                 max_x;
-        int                 min_y;
-        int                 max_y;
-    } calibration;
+        int                 first;
+        int                 num;
+        int                 v[MAX_VALUATORS];
+    } held;
+
+    /* GroupByPhys, see EvdevGroupRead() */
+    struct {
+        char                phys[256];  /* group key, empty if not grouped */
+        InputInfoPtr        pInfo;      /* for the siblings' reads */
+        BOOL                direct;     /* read without the group */
+    } group;
+
+    int num_axis_codes;     /* number of entries in axis_map */
+    int num_buttons;            /* number of buttons */
+
+    /* XKB stuff has to be per-device rather than per-driver */
+#if GET_ABI_MAJOR(ABI_XINPUT_VERSION) < 5
+    XkbComponentNamesRec    xkbnames;
+#endif
+    XkbRMLVOSet rmlvo;
 
     struct {
         int                 min_x;
@@ -164,11 +331,60 @@ typedef struct {
         int                 max_y;
     } resolution;
 
-    unsigned char btnmap[32];           /* config-file specified button mapping */
+    unsigned char *btnmap;              /* config-file specified button mapping */
 
     int reopen_attempts; /* max attempts to re-open after read failure */
     int reopen_left;     /* number of attempts left to re-open the device */
     OsTimerPtr reopen_timer;
+    int reopen_watch;    /* inotify fd on the device node's directory */
+    pointer reopen_handler;
+    CARD32 reopen_deadline; /* ms, when the inotify wait gives up */
+
+    /* Raw event recording, see record.c */
+    struct {
+        char                *path;      /* RecordFile option */
+        int                 fd;         /* -1 if not recording */
+        EvdevRecordEvent    *events;    /* filled by the input handler */
+        EvdevRecordEvent    *flush;     /* written out by the timer */
+        unsigned int        num_events;
+        unsigned int        dropped;
+        OsTimerPtr          timer;
+    } record;
+
+    /* Timeline tracing, see timeline.c */
+    struct {
+        char                *path;      /* TraceFile option */
+        int                 fd;         /* -1 if not tracing */
+        EvdevTraceSpanRec   *spans;     /* filled by the input handler */
+        EvdevTraceSpanRec   *flush;     /* written out by the timer */
+        unsigned int        num_spans;
+        unsigned int        dropped;
+        OsTimerPtr          timer;
+    } trace;
+
+    /* CPU accounting totals, see cpu.c */
+    struct {
+        long long           total[EV_CPU_STAGES];   /* ns, estimated */
+        long long           window[EV_CPU_STAGES];  /* ns since window_start */
+        CARD32              window_start;           /* ms */
+        unsigned int        rate[EV_CPU_STAGES];    /* us/s, moving average */
+    } cpu_stats;
+
+    char *tap_path;         /* TapFile option, see tap.c */
+
+    /* Startup phase times, see startup.c */
+    struct {
+        CARD32              us[EV_STARTUP_PHASES];
+        BOOL                reported;   /* first EvdevOn is done */
+    } startup;
+
+    /* Rate limited messages from the input path, see log.c */
+    struct {
+        unsigned int        head;       /* written by EvdevLog */
+        unsigned int        tail;       /* written by EvdevLogFlush */
+        EvdevLogEntry       entries[EVDEV_LOG_SIZE];
+        EvdevLogBucket      buckets[EVDEV_LOG_COUNT];
+    } log;
 
     //Backup pointer(s) for cursor
     CursorLimitsProcPtr pOrgCursorLimits;
@@ -190,11 +406,36 @@ typedef struct {
     /* minor/major number */
     dev_t min_maj;
 
-    /* Event queue used to defer keyboard/button events until EV_SYN time. */
-    int                     num_queue;
-    EventQueueRec           queue[EVDEV_MAXQUEUE];
+    /* Flight recorder: the last EVDEV_RING_SIZE events read, see record.c.
+     * Written for every event, but one entry at a time. */
+    EvdevRingEntry          ring_entries[EVDEV_RING_SIZE];
 } EvdevRec, *EvdevPtr;
 
+/* Fails to compile if the per-event state outgrows EVDEV_HOT_SIZE. Move
+ * something cold out of it rather than raising the limit. */
+typedef char EvdevHotSizeCheck[offsetof(EvdevRec, ring) +
+                               sizeof(((EvdevRec*)0)->ring) <=
+                               EVDEV_HOT_SIZE ? 1 : -1];
+
+/* Access to the event device nodes. All calls on the device fd go through
+ * evdev_backend, so that a different implementation can stand in for the
+ * kernel, e.g. to simulate devices. */
+typedef struct {
+    int     (*sys_open)(const char *path, int flags);
+    int     (*sys_close)(int fd);
+    int     (*sys_ioctl)(int fd, unsigned long request, void *arg);
+    ssize_t (*sys_read)(int fd, void *buf, size_t count);
+    ssize_t (*sys_write)(int fd, const void *buf, size_t count); /* LEDs */
+    int     (*sys_fstat)(int fd, struct stat *st);  /* major/minor */
+    void    (*sys_flush)(int fd);   /* drop the events queued in the kernel */
+} EvdevBackendRec, *EvdevBackendPtr;
+
+extern const EvdevBackendRec *evdev_backend;
+
+#ifdef ENABLE_MOCK_BACKEND
+const EvdevBackendRec *EvdevMockBackend(const char *spec);
+#endif
+
 /* Event posting functions */
 void EvdevQueueKbdEvent(InputInfoPtr pInfo, struct input_event *ev, int value);
 void EvdevQueueButtonEvent(InputInfoPtr pInfo, int button, int value);
@@ -205,6 +446,7 @@ void EvdevPostRelativeMotionEvents(InputInfoPtr pInfo, int *num_v, int *first_v,
 void EvdevPostAbsoluteMotionEvents(InputInfoPtr pInfo, int *num_v, int *first_v,
 				   int v[MAX_VALUATORS]);
 unsigned int EvdevUtilButtonEventToButtonNumber(EvdevPtr pEvdev, int code);
+void EvdevInitDispatch(InputInfoPtr pInfo);
 
 /* Middle Button emulation */
 int  EvdevMBEmuTimer(InputInfoPtr);
@@ -225,10 +467,66 @@ BOOL EvdevWheelEmuFilterMotion(InputInfoPtr pInfo, struct input_event *pEv);
 void EvdevDragLockPreInit(InputInfoPtr pInfo);
 BOOL EvdevDragLockFilterEvent(InputInfoPtr pInfo, unsigned int button, int value);
 
+/* Store an event in the flight recorder / note what was done with it */
+#define EvdevRingPush(pEvdev, event) do { \
+        (pEvdev)->ring.cur = &(pEvdev)->ring_entries[(pEvdev)->ring.head++ & \
+                                                     (EVDEV_RING_SIZE - 1)]; \
+        (pEvdev)->ring.cur->ev = *(event); \
+        (pEvdev)->ring.cur->decision = EV_RING_SEEN; \
+    } while (0)
+#define EvdevRingMark(pEvdev, d) ((pEvdev)->ring.cur->decision = (d))
+
+/* Event recording */
+void EvdevRecordPreInit(InputInfoPtr pInfo);
+void EvdevRecordEvents(InputInfoPtr pInfo, struct input_event *ev, int count);
+void EvdevRecordStop(InputInfoPtr pInfo);
+void EvdevRingDump(InputInfoPtr pInfo);
+
+/* Timeline tracing. Begin/End cost a branch while tracing is off. */
+#define EvdevTraceBegin(pEvdev, t) do { \
+        if ((pEvdev)->trace.fd != -1) (t) = EvdevTraceNow(); \
+    } while (0)
+#define EvdevTraceEnd(pInfo, pEvdev, type, t) do { \
+        if ((pEvdev)->trace.fd != -1) EvdevTraceSpan(pInfo, type, t); \
+    } while (0)
+
+void EvdevTracePreInit(InputInfoPtr pInfo);
+void EvdevTraceStop(InputInfoPtr pInfo);
+long long EvdevTraceNow(void);
+void EvdevTraceSpan(InputInfoPtr pInfo, int type, long long start);
+
+/* Input path messages */
+void EvdevLog(InputInfoPtr pInfo, int id, int arg);
+void EvdevLogFlush(InputInfoPtr pInfo);
+void EvdevLogPreInit(InputInfoPtr pInfo);
+void EvdevLogInit(InputInfoPtr pInfo);
+void EvdevLogClose(InputInfoPtr pInfo);
+
+/* Event tap */
+void EvdevTapPreInit(InputInfoPtr pInfo);
+void EvdevTapStart(InputInfoPtr pInfo);
+void EvdevTapStop(InputInfoPtr pInfo);
+void EvdevTapWrite(EvdevPtr pEvdev, int kind, int type, int code, int value);
+void EvdevTapMotion(EvdevPtr pEvdev, int kind, int first, int num, int *v);
+
+/* Startup times */
+long long EvdevStartupNow(void);
+void EvdevStartupPhase(EvdevPtr pEvdev, int phase, long long *t);
+void EvdevStartupReport(InputInfoPtr pInfo);
+
+/* CPU accounting */
+void EvdevCpuPreInit(InputInfoPtr pInfo);
+long long EvdevCpuNow(void);
+void EvdevCpuAccount(InputInfoPtr pInfo, long long read, long long process);
+
 #ifdef HAVE_PROPERTIES
 void EvdevMBEmuInitProperty(DeviceIntPtr);
 void EvdevWheelEmuInitProperty(DeviceIntPtr);
 void EvdevDragLockInitProperty(DeviceIntPtr);
+void EvdevRecordInitProperty(DeviceIntPtr);
+void EvdevTraceInitProperty(DeviceIntPtr);
+void EvdevCpuInitProperty(DeviceIntPtr);
+void EvdevStartupInitProperty(DeviceIntPtr);
 #endif
 #endif
 
@@ -0,0 +1,238 @@
+/*
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of the authors
+ * not be used in advertising or publicity pertaining to distribution
+ * of the software without specific, written prior permission.  The
+ * authors make no representations about the suitability of this software
+ * for any purpose.  It is provided "as is" without express or implied
+ * warranty.
+ *
+ * THE AUTHORS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Messages from the input path.
+ *
+ * EvdevLog may be called in signal context. It doesn't format anything,
+ * it only stores the message id and its arguments in a per-device ring.
+ * The ring is written to the log from the block handler. Each message id
+ * has a token bucket per device: EVDEV_LOG_BURST messages go through
+ * right away, then one per EVDEV_LOG_INTERVAL ms. The others are counted,
+ * and the count is logged with the next message that goes through, or on
+ * its own once the bucket has refilled if no message follows.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <xf86.h>
+#include <xf86Xinput.h>
+
+#include <string.h>
+
+#include "evdev.h"
+
+#define EVDEV_LOG_BURST     5
+#define EVDEV_LOG_INTERVAL  1000    /* ms per token */
+
+static const struct {
+    MessageType type;
+    const char *name;   /* for the count of suppressed messages */
+    const char *format; /* gets the device name, then the argument */
+} log_messages[] = {
+    [EVDEV_LOG_QUEUE_FULL]      = { X_NONE,    "full queue",      "%s: dropping event due to full queue!\n" },
+    [EVDEV_LOG_READ_ERROR]      = { X_NONE,    "read error",      "%s: Read error: %s\n" },
+    [EVDEV_LOG_KEYCODE]         = { X_WARNING, "unknown keycode", "%s: unable to handle keycode %d\n" },
+};
+
+/**
+ * Queue a message for the log, unless the message is rate limited. arg is
+ * passed to the format, as a string through strerror() for the messages
+ * that print an error.
+ */
+void
+EvdevLog(InputInfoPtr pInfo, int id, int arg)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    EvdevLogBucket *bucket = &pEvdev->log.buckets[id];
+    EvdevLogEntry *entry;
+    CARD32 now = GetTimeInMillis();
+    CARD32 tokens;
+
+    tokens = (now - bucket->last) / EVDEV_LOG_INTERVAL;
+    if (tokens)
+    {
+        bucket->tokens = min(bucket->tokens + tokens, EVDEV_LOG_BURST);
+        bucket->last += tokens * EVDEV_LOG_INTERVAL;
+    }
+
+    if (!bucket->tokens ||
+        pEvdev->log.head - pEvdev->log.tail >= EVDEV_LOG_SIZE)
+    {
+        bucket->suppressed++;
+        return;
+    }
+
+    bucket->tokens--;
+
+    entry = &pEvdev->log.entries[pEvdev->log.head & (EVDEV_LOG_SIZE - 1)];
+    entry->id = id;
+    entry->arg = arg;
+    entry->suppressed = bucket->suppressed;
+    bucket->suppressed = 0;
+    pEvdev->log.head++;
+}
+
+/**
+ * @return The ms until the bucket has a token again, 0 if it has one.
+ */
+static CARD32
+EvdevLogRefillDelay(EvdevLogBucket *bucket, CARD32 now)
+{
+    if (bucket->tokens || now - bucket->last >= EVDEV_LOG_INTERVAL)
+        return 0;
+    return EVDEV_LOG_INTERVAL - (now - bucket->last);
+}
+
+static BOOL
+EvdevLogPending(EvdevPtr pEvdev)
+{
+    int id;
+
+    if (pEvdev->log.head != pEvdev->log.tail)
+        return TRUE;
+    for (id = 0; id < EVDEV_LOG_COUNT; id++)
+        if (pEvdev->log.buckets[id].suppressed)
+            return TRUE;
+    return FALSE;
+}
+
+/**
+ * Write the queued messages to the log, then the counts of the messages
+ * suppressed since. A count is only written once its bucket has refilled,
+ * unless all is set; until then it may still go out with the next message.
+ */
+static void
+EvdevLogWrite(InputInfoPtr pInfo, BOOL all)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    EvdevLogEntry entries[EVDEV_LOG_SIZE];
+    unsigned int suppressed[EVDEV_LOG_COUNT];
+    CARD32 now = GetTimeInMillis();
+    unsigned int i, num;
+    int id, block;
+
+    if (!EvdevLogPending(pEvdev))
+        return;
+
+    block = xf86BlockSIGIO();
+    for (num = 0; pEvdev->log.tail != pEvdev->log.head; num++)
+        entries[num] = pEvdev->log.entries[pEvdev->log.tail++ &
+                                           (EVDEV_LOG_SIZE - 1)];
+    for (id = 0; id < EVDEV_LOG_COUNT; id++)
+    {
+        EvdevLogBucket *bucket = &pEvdev->log.buckets[id];
+
+        suppressed[id] = 0;
+        if (all || !EvdevLogRefillDelay(bucket, now))
+        {
+            suppressed[id] = bucket->suppressed;
+            bucket->suppressed = 0;
+        }
+    }
+    xf86UnblockSIGIO(block);
+
+    for (i = 0; i < num; i++)
+    {
+        id = entries[i].id;
+
+        if (entries[i].suppressed)
+            xf86Msg(X_INFO, "%s: %u similar messages suppressed\n",
+                    pInfo->name, entries[i].suppressed);
+
+        if (id == EVDEV_LOG_READ_ERROR)
+            xf86Msg(log_messages[id].type, log_messages[id].format,
+                    pInfo->name, strerror(entries[i].arg));
+        else
+            xf86Msg(log_messages[id].type, log_messages[id].format,
+                    pInfo->name, entries[i].arg);
+    }
+
+    for (id = 0; id < EVDEV_LOG_COUNT; id++)
+        if (suppressed[id])
+            xf86Msg(X_INFO, "%s: %u '%s' messages suppressed\n",
+                    pInfo->name, suppressed[id], log_messages[id].name);
+}
+
+void
+EvdevLogFlush(InputInfoPtr pInfo)
+{
+    EvdevLogWrite(pInfo, FALSE);
+}
+
+static void
+EvdevLogBlockHandler(pointer data, struct timeval **waitTime,
+                     pointer LastSelectMask)
+{
+    InputInfoPtr pInfo = data;
+    EvdevPtr pEvdev = pInfo->private;
+    CARD32 now = GetTimeInMillis();
+    int id;
+
+    EvdevLogFlush(pInfo);
+
+    /* wake up for the counts still waiting for their bucket to refill */
+    for (id = 0; id < EVDEV_LOG_COUNT; id++)
+    {
+        EvdevLogBucket *bucket = &pEvdev->log.buckets[id];
+
+        if (bucket->suppressed)
+            AdjustWaitForDelay(waitTime, EvdevLogRefillDelay(bucket, now));
+    }
+}
+
+static void
+EvdevLogWakeupHandler(pointer data, int i, pointer LastSelectMask)
+{
+}
+
+void
+EvdevLogPreInit(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    CARD32 now = GetTimeInMillis();
+    int i;
+
+    memset(&pEvdev->log, 0, sizeof(pEvdev->log));
+    for (i = 0; i < EVDEV_LOG_COUNT; i++)
+    {
+        pEvdev->log.buckets[i].tokens = EVDEV_LOG_BURST;
+        pEvdev->log.buckets[i].last = now;
+    }
+}
+
+void
+EvdevLogInit(InputInfoPtr pInfo)
+{
+    RegisterBlockAndWakeupHandlers(EvdevLogBlockHandler,
+                                   EvdevLogWakeupHandler,
+                                   (pointer)pInfo);
+}
+
+void
+EvdevLogClose(InputInfoPtr pInfo)
+{
+    RemoveBlockAndWakeupHandlers(EvdevLogBlockHandler,
+                                 EvdevLogWakeupHandler,
+                                 (pointer)pInfo);
+    EvdevLogWrite(pInfo, TRUE);
+}
@@ -0,0 +1,563 @@
+/*
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of the authors
+ * not be used in advertising or publicity pertaining to distribution
+ * of the software without specific, written prior permission.  The
+ * authors make no representations about the suitability of this software
+ * for any purpose.  It is provided "as is" without express or implied
+ * warranty.
+ *
+ * THE AUTHORS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Simulated event devices, to benchmark device bring-up and recovery
+ * without the hardware. Only built with --enable-mock-backend.
+ *
+ * The backend is selected when the module is loaded if EVDEV_MOCK is set
+ * in the server's environment. Its value is a comma-separated list of
+ * settings, all of them optional:
+ *
+ *   latency=us   delay of every ioctl
+ *   probe=us     delay of opening the device
+ *   enodev=n     every n-th read fails with ENODEV, as after a resume
+ *   dropped=n    every n-th frame is preceded by a SYN_DROPPED
+ *   rate=hz      frames per second and device, default 100
+ *
+ * A device whose node is named mock-mouse, mock-keyboard or
+ * mock-touchscreen, optionally followed by a number, is simulated; all
+ * other nodes are opened as usual. Each device is a pipe that a timer
+ * fills with frames, so the server's select() and SIGIO work on it
+ * unchanged. A frame that does not fit into the pipe is dropped and the
+ * next one starts with a SYN_DROPPED, like the kernel does.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <xf86.h>
+#include <xf86Xinput.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/time.h>
+
+#include "evdev.h"
+
+#ifdef ENABLE_MOCK_BACKEND
+
+#ifndef SYN_DROPPED
+#define SYN_DROPPED 3
+#endif
+
+#ifndef BUS_VIRTUAL
+#define BUS_VIRTUAL 0x06
+#endif
+
+#define MOCK_MAX_DEVICES 16
+#define MOCK_MAX_FRAME   5      /* events per frame, including the SYN */
+
+typedef enum {
+    MOCK_MOUSE,
+    MOCK_KEYBOARD,
+    MOCK_TOUCHSCREEN,
+} MockKind;
+
+static const char *mock_kinds[] = {
+    [MOCK_MOUSE]        = "mouse",
+    [MOCK_KEYBOARD]     = "keyboard",
+    [MOCK_TOUCHSCREEN]  = "touchscreen",
+};
+
+typedef struct {
+    int fd;             /* read end, handed out; -1 if the slot is free */
+    int wfd;            /* write end, filled by MockTimer */
+    MockKind kind;
+    int num;            /* number after the kind in the node name */
+    unsigned int reads;
+    unsigned int frames;
+    BOOL gone;          /* ENODEV until the device is closed */
+    BOOL overflow;      /* last frame did not fit */
+} MockDevice;
+
+static struct {
+    unsigned long latency;
+    unsigned long probe;
+    unsigned int enodev;
+    unsigned int dropped;
+    unsigned int rate;
+} mock_config = { 0, 0, 0, 0, 100 };
+
+static MockDevice mock_devices[MOCK_MAX_DEVICES];
+static OsTimerPtr mock_timer;
+static BOOL mock_timer_running;
+
+static MockDevice*
+MockLookup(int fd)
+{
+    int i;
+
+    if (fd < 0)
+        return NULL;
+
+    for (i = 0; i < MOCK_MAX_DEVICES; i++)
+        if (mock_devices[i].fd == fd)
+            return &mock_devices[i];
+    return NULL;
+}
+
+/**
+ * Parse the node name, e.g. /dev/input/mock-mouse2.
+ *
+ * @return TRUE if the node is one of ours.
+ */
+static BOOL
+MockParsePath(const char *path, MockKind *kind, int *num)
+{
+    const char *name = strrchr(path, '/');
+    int i;
+
+    name = name ? name + 1 : path;
+    if (strncmp(name, "mock-", 5))
+        return FALSE;
+    name += 5;
+
+    for (i = 0; i < sizeof(mock_kinds)/sizeof(mock_kinds[0]); i++)
+    {
+        size_t len = strlen(mock_kinds[i]);
+
+        if (strncmp(name, mock_kinds[i], len))
+            continue;
+        *kind = i;
+        *num = atoi(name + len);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static void
+MockEvent(struct input_event *ev, struct timeval *tv, int type, int code,
+          int value)
+{
+    ev->time = *tv;
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+}
+
+/**
+ * Fill ev with the next frame of the device.
+ *
+ * @return The number of events in the frame.
+ */
+static int
+MockFrame(MockDevice *dev, struct input_event *ev)
+{
+    struct timeval tv;
+    unsigned int f = dev->frames;
+    int n = 0;
+
+    gettimeofday(&tv, NULL);
+
+    switch (dev->kind)
+    {
+        case MOCK_MOUSE:
+            /* a square, 100 frames per side */
+            MockEvent(&ev[n++], &tv, EV_REL, REL_X,
+                      ((f / 100) & 1) ? -1 : 1);
+            MockEvent(&ev[n++], &tv, EV_REL, REL_Y,
+                      ((f / 200) & 1) ? -1 : 1);
+            break;
+        case MOCK_KEYBOARD:
+            MockEvent(&ev[n++], &tv, EV_KEY, KEY_A, !(f & 1));
+            break;
+        case MOCK_TOUCHSCREEN:
+            /* touch down for 100 frames, up for 100 frames */
+            if (f % 100 == 0)
+                MockEvent(&ev[n++], &tv, EV_KEY, BTN_TOUCH, !((f / 100) & 1));
+            MockEvent(&ev[n++], &tv, EV_ABS, ABS_X, (f * 16) & 4095);
+            MockEvent(&ev[n++], &tv, EV_ABS, ABS_Y, (f * 8) & 4095);
+            break;
+    }
+    MockEvent(&ev[n++], &tv, EV_SYN, SYN_REPORT, 0);
+
+    return n;
+}
+
+static void
+MockFeed(MockDevice *dev)
+{
+    struct input_event ev[2 * MOCK_MAX_FRAME];
+    struct timeval tv;
+    int n = 0;
+
+    if (dev->overflow)
+    {
+        gettimeofday(&tv, NULL);
+        MockEvent(&ev[n++], &tv, EV_SYN, SYN_DROPPED, 0);
+    } else if (mock_config.dropped &&
+               dev->frames % mock_config.dropped == mock_config.dropped - 1)
+    {
+        /* half a frame, then the kernel's buffer overflowed */
+        n = MockFrame(dev, ev) - 1;
+        MockEvent(&ev[n], &ev[0].time, EV_SYN, SYN_DROPPED, 0);
+        n++;
+    }
+
+    n += MockFrame(dev, &ev[n]);
+
+    /* at most PIPE_BUF, so the frame is written whole or not at all */
+    dev->overflow = (write(dev->wfd, ev, n * sizeof(ev[0])) < 0);
+    dev->frames++;
+}
+
+static CARD32
+MockTimer(OsTimerPtr timer, CARD32 time, pointer arg)
+{
+    BOOL active = FALSE;
+    int i;
+
+    for (i = 0; i < MOCK_MAX_DEVICES; i++)
+    {
+        MockDevice *dev = &mock_devices[i];
+
+        if (dev->fd == -1 || dev->gone)
+            continue;
+        MockFeed(dev);
+        active = TRUE;
+    }
+
+    if (!active)
+    {
+        mock_timer_running = FALSE;
+        return 0;
+    }
+    return max(1000 / mock_config.rate, 1);
+}
+
+static int
+MockOpen(const char *path, int flags)
+{
+    MockDevice *dev = NULL;
+    MockKind kind;
+    int num;
+    int fds[2];
+    int i;
+
+    if (!MockParsePath(path, &kind, &num))
+        return open(path, flags, 0);
+
+    for (i = 0; i < MOCK_MAX_DEVICES && !dev; i++)
+        if (mock_devices[i].fd == -1)
+            dev = &mock_devices[i];
+    if (!dev)
+    {
+        errno = EMFILE;
+        return -1;
+    }
+
+    if (mock_config.probe)
+        usleep(mock_config.probe);
+
+    if (pipe(fds) == -1)
+        return -1;
+
+    for (i = 0; i < 2; i++)
+    {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    }
+
+    memset(dev, 0, sizeof(*dev));
+    dev->fd = fds[0];
+    dev->wfd = fds[1];
+    dev->kind = kind;
+    dev->num = num;
+
+    if (!mock_timer_running)
+    {
+        mock_timer = TimerSet(mock_timer, 0, max(1000 / mock_config.rate, 1),
+                              MockTimer, NULL);
+        mock_timer_running = TRUE;
+    }
+
+    return dev->fd;
+}
+
+/* May be called from the input handler, in signal context. */
+static int
+MockClose(int fd)
+{
+    MockDevice *dev = MockLookup(fd);
+
+    if (dev)
+    {
+        close(dev->wfd);
+        dev->fd = -1;
+    }
+    return close(fd);
+}
+
+static void
+MockSetBits(void *arg, size_t size, int first, int last)
+{
+    unsigned long *bits = arg;
+    int i;
+
+    for (i = first; i <= last && i < size * 8; i++)
+        bits[i / LONG_BITS] |= 1UL << (i % LONG_BITS);
+}
+
+static int
+MockGetBits(MockDevice *dev, int type, void *arg, size_t size)
+{
+    memset(arg, 0, size);
+
+    switch (type)
+    {
+        case 0:
+            MockSetBits(arg, size, EV_SYN, EV_SYN);
+            MockSetBits(arg, size, EV_KEY, EV_KEY);
+            if (dev->kind == MOCK_MOUSE)
+                MockSetBits(arg, size, EV_REL, EV_REL);
+            if (dev->kind == MOCK_KEYBOARD)
+                MockSetBits(arg, size, EV_LED, EV_LED);
+            if (dev->kind == MOCK_TOUCHSCREEN)
+                MockSetBits(arg, size, EV_ABS, EV_ABS);
+            break;
+        case EV_KEY:
+            if (dev->kind == MOCK_MOUSE)
+                MockSetBits(arg, size, BTN_LEFT, BTN_MIDDLE);
+            if (dev->kind == MOCK_KEYBOARD)
+                MockSetBits(arg, size, KEY_ESC, KEY_MICMUTE);
+            if (dev->kind == MOCK_TOUCHSCREEN)
+                MockSetBits(arg, size, BTN_TOUCH, BTN_TOUCH);
+            break;
+        case EV_REL:
+            if (dev->kind == MOCK_MOUSE)
+            {
+                MockSetBits(arg, size, REL_X, REL_Y);
+                MockSetBits(arg, size, REL_WHEEL, REL_WHEEL);
+            }
+            break;
+        case EV_ABS:
+            if (dev->kind == MOCK_TOUCHSCREEN)
+                MockSetBits(arg, size, ABS_X, ABS_Y);
+            break;
+        case EV_LED:
+            if (dev->kind == MOCK_KEYBOARD)
+                MockSetBits(arg, size, LED_NUML, LED_SCROLLL);
+            break;
+    }
+
+    return size;
+}
+
+static int
+MockIoctl(int fd, unsigned long request, void *arg)
+{
+    MockDevice *dev = MockLookup(fd);
+    size_t size = _IOC_SIZE(request);
+    int nr = _IOC_NR(request);
+
+    if (!dev)
+        return ioctl(fd, request, arg);
+
+    if (mock_config.latency)
+        usleep(mock_config.latency);
+
+    if (dev->gone)
+    {
+        errno = ENODEV;
+        return -1;
+    }
+
+    if (request == EVIOCGRAB || request == EVIOCSMASK ||
+        request == EVIOCSKEYCODE)
+        return 0;
+
+    if (request == EVIOCGID)
+    {
+        struct input_id *id = arg;
+
+        memset(id, 0, sizeof(*id));
+        id->bustype = BUS_VIRTUAL;
+        id->product = dev->kind;
+        return 0;
+    }
+
+    if (_IOC_TYPE(request) != 'E' || _IOC_DIR(request) != _IOC_READ)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (nr == _IOC_NR(EVIOCGNAME(0)))
+    {
+        snprintf(arg, size, "Mock %s %d", mock_kinds[dev->kind], dev->num);
+        return strlen(arg) + 1;
+    } else if (nr == _IOC_NR(EVIOCGPHYS(0)))
+    {
+        snprintf(arg, size, "mock-%s%d/input0", mock_kinds[dev->kind],
+                 dev->num);
+        return strlen(arg) + 1;
+    } else if (nr == _IOC_NR(EVIOCGKEY(0)))
+    {
+        memset(arg, 0, size);
+        return size;
+    } else if (nr >= _IOC_NR(EVIOCGBIT(0, 0)) &&
+               nr < _IOC_NR(EVIOCGBIT(EV_MAX, 0)))
+    {
+        return MockGetBits(dev, nr - _IOC_NR(EVIOCGBIT(0, 0)), arg, size);
+    } else if (nr >= _IOC_NR(EVIOCGABS(0)) &&
+               nr <= _IOC_NR(EVIOCGABS(ABS_MAX)))
+    {
+        struct input_absinfo *absinfo = arg;
+
+        memset(absinfo, 0, sizeof(*absinfo));
+        if (dev->kind == MOCK_TOUCHSCREEN)
+            absinfo->maximum = 4095;
+        return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+/* Called from the input handler, in signal context. */
+static ssize_t
+MockRead(int fd, void *buf, size_t count)
+{
+    MockDevice *dev = MockLookup(fd);
+
+    if (dev)
+    {
+        if (!dev->gone && mock_config.enodev &&
+            ++dev->reads % mock_config.enodev == 0)
+            dev->gone = TRUE;
+        if (dev->gone)
+        {
+            errno = ENODEV;
+            return -1;
+        }
+    }
+
+    return read(fd, buf, count);
+}
+
+static ssize_t
+MockWrite(int fd, const void *buf, size_t count)
+{
+    if (MockLookup(fd))
+        return count; /* LEDs have nowhere to go */
+
+    return write(fd, buf, count);
+}
+
+static int
+MockFstat(int fd, struct stat *st)
+{
+    MockDevice *dev = MockLookup(fd);
+
+    if (!dev)
+        return fstat(fd, st);
+
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFCHR | 0660;
+    /* distinct from the real event nodes, 13:64 and up */
+    st->st_rdev = makedev(13, 1024 + dev->kind * 256 + (dev->num & 255));
+    return 0;
+}
+
+static void
+MockFlush(int fd)
+{
+    struct input_event ev[MOCK_MAX_FRAME * 8];
+
+    if (!MockLookup(fd))
+    {
+        xf86FlushInput(fd);
+        return;
+    }
+
+    while (read(fd, ev, sizeof(ev)) > 0)
+        ;
+}
+
+static const EvdevBackendRec mock_backend = {
+    MockOpen,
+    MockClose,
+    MockIoctl,
+    MockRead,
+    MockWrite,
+    MockFstat,
+    MockFlush,
+};
+
+/**
+ * Parse the EVDEV_MOCK settings, see the top of this file.
+ *
+ * @return The mock backend.
+ */
+const EvdevBackendRec*
+EvdevMockBackend(const char *spec)
+{
+    char *copy = strdup(spec);
+    char *opt, *save = NULL;
+    int i;
+
+    for (i = 0; i < MOCK_MAX_DEVICES; i++)
+        mock_devices[i].fd = -1;
+
+    for (opt = copy ? strtok_r(copy, ",", &save) : NULL; opt;
+         opt = strtok_r(NULL, ",", &save))
+    {
+        char *value = strchr(opt, '=');
+        unsigned long v;
+
+        if (!value)
+            continue;
+        *value++ = '\0';
+        v = strtoul(value, NULL, 0);
+
+        if (!strcmp(opt, "latency"))
+            mock_config.latency = v;
+        else if (!strcmp(opt, "probe"))
+            mock_config.probe = v;
+        else if (!strcmp(opt, "enodev"))
+            mock_config.enodev = v;
+        else if (!strcmp(opt, "dropped"))
+            mock_config.dropped = v;
+        else if (!strcmp(opt, "rate") && v > 0)
+            mock_config.rate = v;
+        else
+            xf86Msg(X_WARNING, "evdev: unknown EVDEV_MOCK setting '%s'\n",
+                    opt);
+    }
+    free(copy);
+
+    xf86Msg(X_WARNING, "evdev: simulating mock-* devices: ioctl latency %lu us, "
+            "probe %lu us, ENODEV every %u reads, SYN_DROPPED every %u "
+            "frames, %u Hz\n", mock_config.latency, mock_config.probe,
+            mock_config.enodev, mock_config.dropped, mock_config.rate);
+
+    return &mock_backend;
+}
+
+#endif /* ENABLE_MOCK_BACKEND */
@@ -0,0 +1,397 @@
+/*
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of the authors
+ * not be used in advertising or publicity pertaining to distribution
+ * of the software without specific, written prior permission.  The
+ * authors make no representations about the suitability of this software
+ * for any purpose.  It is provided "as is" without express or implied
+ * warranty.
+ *
+ * THE AUTHORS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Recording of the raw event stream, see evdev-record.h for the format, and
+ * the flight recorder that keeps the last few events of every device.
+ *
+ * Like tracing, the input handler only stores the events in a buffer, which
+ * is written out from a timer every EVDEV_RECORD_FLUSH ms. Events that
+ * don't fit until then are counted and dropped, a slow disk never stalls
+ * the input path. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <X11/Xatom.h>
+#include <xf86.h>
+#include <xf86Xinput.h>
+#include <exevents.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <evdev-properties.h>
+#include "evdev.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#define EVDEV_RECORD_FLUSH 100  /* ms between writes */
+
+#define TestBit(bit, array) ((array[(bit) / LONG_BITS]) & (1L << ((bit) % LONG_BITS)))
+
+#ifdef HAVE_PROPERTIES
+static Atom prop_record = 0; /* Recording on/off */
+static Atom prop_flight_recorder = 0; /* Dump the ring to the log */
+#endif
+
+static const char *ring_decisions[] = {
+    [EV_RING_SEEN]      = "",
+    [EV_RING_IGNORED]   = "ignored",
+    [EV_RING_SWALLOWED] = "swallowed",
+    [EV_RING_QUEUED]    = "queued",
+    [EV_RING_DROPPED]   = "dropped",
+    [EV_RING_POSTED]    = "posted",
+    [EV_RING_COALESCED] = "coalesced",
+};
+
+static void
+EvdevRecordBits(uint8_t *dst, int dst_bits, unsigned long *src, int src_bits)
+{
+    int i;
+
+    for (i = 0; i < dst_bits && i < src_bits; i++)
+        if (TestBit(i, src))
+            dst[i / 8] |= 1 << (i % 8);
+}
+
+static BOOL
+EvdevRecordWrite(int fd, char *buf, int len)
+{
+    int n;
+
+    while (len > 0)
+    {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        buf += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Swap the event buffers and write out the events recorded so far.
+ */
+static BOOL
+EvdevRecordFlush(InputInfoPtr pInfo, int fd)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    EvdevRecordEvent *events;
+    unsigned int num, dropped;
+    int block;
+
+    block = xf86BlockSIGIO();
+    events = pEvdev->record.events;
+    num = pEvdev->record.num_events;
+    dropped = pEvdev->record.dropped;
+    pEvdev->record.events = pEvdev->record.flush;
+    pEvdev->record.flush = events;
+    pEvdev->record.num_events = 0;
+    pEvdev->record.dropped = 0;
+    xf86UnblockSIGIO(block);
+
+    if (dropped)
+        xf86Msg(X_WARNING, "%s: record buffer full, %u events dropped\n",
+                pInfo->name, dropped);
+
+    return EvdevRecordWrite(fd, (char*)events, num * sizeof(*events));
+}
+
+static CARD32
+EvdevRecordTimer(OsTimerPtr timer, CARD32 time, pointer arg)
+{
+    InputInfoPtr pInfo = (InputInfoPtr)arg;
+    EvdevPtr pEvdev = pInfo->private;
+
+    if (!EvdevRecordFlush(pInfo, pEvdev->record.fd))
+    {
+        xf86Msg(X_ERROR, "%s: Recording stopped: %s\n", pInfo->name,
+                strerror(errno));
+        EvdevRecordStop(pInfo);
+        return 0;
+    }
+
+    return EVDEV_RECORD_FLUSH;
+}
+
+/**
+ * Open the RecordFile, write the header describing the device and start
+ * collecting events.
+ *
+ * @return Success or the X error to return to the client.
+ */
+static int
+EvdevRecordStart(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    EvdevRecordHeader header;
+    struct input_id id;
+    int fd, i;
+
+    if (pEvdev->record.fd != -1)
+        return Success;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EVDEV_RECORD_MAGIC, sizeof(header.magic));
+    header.version = EVDEV_RECORD_VERSION;
+    header.header_size = sizeof(header);
+
+    if (pInfo->fd != -1 && evdev_backend->sys_ioctl(pInfo->fd, EVIOCGID, &id) == 0)
+    {
+        header.bustype = id.bustype;
+        header.vendor = id.vendor;
+        header.product = id.product;
+        header.id_version = id.version;
+    }
+
+    strncpy(header.name, pEvdev->name, sizeof(header.name) - 1);
+    EvdevRecordBits(header.ev_bits, EVDEV_RECORD_EV_CNT,
+                    pEvdev->bitmask, EV_CNT);
+    EvdevRecordBits(header.key_bits, EVDEV_RECORD_KEY_CNT,
+                    pEvdev->key_bitmask, KEY_CNT);
+    EvdevRecordBits(header.rel_bits, EVDEV_RECORD_REL_CNT,
+                    pEvdev->rel_bitmask, REL_CNT);
+    EvdevRecordBits(header.abs_bits, EVDEV_RECORD_ABS_CNT,
+                    pEvdev->abs_bitmask, ABS_CNT);
+
+    for (i = 0; i < EVDEV_RECORD_ABS_CNT && i < ABS_CNT; i++)
+    {
+        header.absinfo[i].value = pEvdev->absinfo[i].value;
+        header.absinfo[i].minimum = pEvdev->absinfo[i].minimum;
+        header.absinfo[i].maximum = pEvdev->absinfo[i].maximum;
+        header.absinfo[i].fuzz = pEvdev->absinfo[i].fuzz;
+        header.absinfo[i].flat = pEvdev->absinfo[i].flat;
+    }
+
+    pEvdev->record.events = calloc(2 * EVDEV_RECORD_EVENTS,
+                                   sizeof(EvdevRecordEvent));
+    if (!pEvdev->record.events)
+        return BadAlloc;
+    pEvdev->record.flush = pEvdev->record.events + EVDEV_RECORD_EVENTS;
+
+    fd = open(pEvdev->record.path,
+              O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        xf86Msg(X_ERROR, "%s: Cannot open %s for recording: %s\n",
+                pInfo->name, pEvdev->record.path, strerror(errno));
+        free(pEvdev->record.events);
+        pEvdev->record.events = NULL;
+        return BadAccess;
+    }
+
+    if (!EvdevRecordWrite(fd, (char*)&header, sizeof(header)))
+    {
+        xf86Msg(X_ERROR, "%s: Cannot write to %s: %s\n",
+                pInfo->name, pEvdev->record.path, strerror(errno));
+        close(fd);
+        free(pEvdev->record.events);
+        pEvdev->record.events = NULL;
+        return BadAccess;
+    }
+
+    pEvdev->record.num_events = 0;
+    pEvdev->record.dropped = 0;
+    pEvdev->record.fd = fd;
+    pEvdev->record.timer = TimerSet(pEvdev->record.timer, 0,
+                                    EVDEV_RECORD_FLUSH, EvdevRecordTimer,
+                                    pInfo);
+
+    xf86Msg(X_INFO, "%s: Recording to %s\n", pInfo->name, pEvdev->record.path);
+    return Success;
+}
+
+void
+EvdevRecordStop(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    int fd, block;
+
+    if (pEvdev->record.fd == -1)
+        return;
+
+    if (pEvdev->record.timer)
+    {
+        TimerFree(pEvdev->record.timer);
+        pEvdev->record.timer = NULL;
+    }
+
+    block = xf86BlockSIGIO();
+    fd = pEvdev->record.fd;
+    pEvdev->record.fd = -1;
+    xf86UnblockSIGIO(block);
+
+    EvdevRecordFlush(pInfo, fd);
+    close(fd);
+
+    /* the buffers may be swapped, free the one calloc returned */
+    free(pEvdev->record.events < pEvdev->record.flush ?
+         pEvdev->record.events : pEvdev->record.flush);
+    pEvdev->record.events = NULL;
+    pEvdev->record.flush = NULL;
+}
+
+/**
+ * Append the events just read from the device to the recording buffer.
+ * Called from EvdevReadInput, possibly in signal context.
+ */
+void
+EvdevRecordEvents(InputInfoPtr pInfo, struct input_event *ev, int count)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    EvdevRecordEvent *rec;
+    int i;
+
+    if (count > EVDEV_RECORD_EVENTS - pEvdev->record.num_events)
+    {
+        pEvdev->record.dropped += count;
+        return;
+    }
+
+    rec = pEvdev->record.events + pEvdev->record.num_events;
+    for (i = 0; i < count; i++)
+    {
+        rec[i].sec = ev[i].time.tv_sec;
+        rec[i].usec = ev[i].time.tv_usec;
+        rec[i].type = ev[i].type;
+        rec[i].code = ev[i].code;
+        rec[i].value = ev[i].value;
+    }
+    pEvdev->record.num_events += count;
+}
+
+/**
+ * Write the flight recorder to the log, oldest event first.
+ */
+void
+EvdevRingDump(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    EvdevRingEntry *e;
+    unsigned int i, head;
+    int block;
+
+    block = xf86BlockSIGIO();
+
+    head = pEvdev->ring.head;
+    i = (head > EVDEV_RING_SIZE) ? head - EVDEV_RING_SIZE : 0;
+
+    xf86Msg(X_INFO, "%s: last %u events:\n", pInfo->name, head - i);
+    for (; i != head; i++)
+    {
+        e = &pEvdev->ring_entries[i & (EVDEV_RING_SIZE - 1)];
+        xf86Msg(X_NONE, "  %ld.%06ld type %d code %d value %d %s\n",
+                (long)e->ev.time.tv_sec, (long)e->ev.time.tv_usec,
+                e->ev.type, e->ev.code, e->ev.value,
+                ring_decisions[e->decision]);
+    }
+
+    xf86UnblockSIGIO(block);
+}
+
+void
+EvdevRecordPreInit(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+
+    pEvdev->ring.cur = pEvdev->ring_entries;
+    pEvdev->record.fd = -1;
+    pEvdev->record.path = xf86CheckStrOption(pInfo->options, "RecordFile", NULL);
+    if (pEvdev->record.path)
+        xf86Msg(X_CONFIG, "%s: RecordFile '%s'\n", pInfo->name,
+                pEvdev->record.path);
+}
+
+#ifdef HAVE_PROPERTIES
+static int
+EvdevRecordSetProperty(DeviceIntPtr dev, Atom atom, XIPropertyValuePtr val,
+                       BOOL checkonly)
+{
+    InputInfoPtr pInfo  = dev->public.devicePrivate;
+
+    if (atom == prop_record)
+    {
+        if (val->format != 8 || val->size != 1 || val->type != XA_INTEGER)
+            return BadMatch;
+
+        if (!checkonly)
+        {
+            if (*((CARD8*)val->data))
+                return EvdevRecordStart(pInfo);
+            EvdevRecordStop(pInfo);
+        }
+    } else if (atom == prop_flight_recorder)
+    {
+        if (val->format != 8 || val->size != 1 || val->type != XA_INTEGER)
+            return BadMatch;
+
+        if (!checkonly && *((CARD8*)val->data))
+            EvdevRingDump(pInfo);
+    }
+
+    return Success;
+}
+
+/**
+ * Initialise the recording properties. Only devices with a RecordFile get
+ * the recording one, clients can't make the driver write anywhere else.
+ */
+void
+EvdevRecordInitProperty(DeviceIntPtr dev)
+{
+    InputInfoPtr pInfo  = dev->public.devicePrivate;
+    EvdevPtr     pEvdev = pInfo->private;
+    BOOL         off    = FALSE;
+    int          rc;
+
+    prop_flight_recorder = MakeAtom(EVDEV_PROP_FLIGHT_RECORDER,
+                                    strlen(EVDEV_PROP_FLIGHT_RECORDER), TRUE);
+    rc = XIChangeDeviceProperty(dev, prop_flight_recorder, XA_INTEGER, 8,
+                                PropModeReplace, 1, &off, FALSE);
+    if (rc != Success)
+        return;
+
+    XISetDevicePropertyDeletable(dev, prop_flight_recorder, FALSE);
+
+    if (pEvdev->record.path)
+    {
+        prop_record = MakeAtom(EVDEV_PROP_RECORD, strlen(EVDEV_PROP_RECORD), TRUE);
+        rc = XIChangeDeviceProperty(dev, prop_record, XA_INTEGER, 8,
+                                    PropModeReplace, 1, &off, FALSE);
+        if (rc != Success)
+            return;
+
+        XISetDevicePropertyDeletable(dev, prop_record, FALSE);
+    }
+
+    XIRegisterPropertyHandler(dev, EvdevRecordSetProperty, NULL, NULL);
+}
+#endif
@@ -0,0 +1,139 @@
+/*
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of the authors
+ * not be used in advertising or publicity pertaining to distribution
+ * of the software without specific, written prior permission.  The
+ * authors make no representations about the suitability of this software
+ * for any purpose.  It is provided "as is" without express or implied
+ * warranty.
+ *
+ * THE AUTHORS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Time spent bringing a device up, from EvdevPreInit to the first
+ * EvdevOn. The phases don't overlap, they add up to the driver's share of
+ * the device's startup. The breakdown is logged once the device is first
+ * switched on, and published through the "Evdev Startup Times" property.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <X11/Xatom.h>
+#include <xf86.h>
+#include <xf86Xinput.h>
+#include <exevents.h>
+
+#include <string.h>
+#include <time.h>
+
+#include <evdev-properties.h>
+#include "evdev.h"
+
+#ifdef HAVE_PROPERTIES
+static Atom prop_startup = 0;       /* phase times, read-only */
+static BOOL startup_updating = FALSE; /* the driver is changing prop_startup */
+#endif
+
+/**
+ * @return The current monotonic time in microseconds.
+ */
+long long
+EvdevStartupNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Add the time since *t to the phase and restart *t. *t is from
+ * EvdevStartupNow().
+ */
+void
+EvdevStartupPhase(EvdevPtr pEvdev, int phase, long long *t)
+{
+    long long now = EvdevStartupNow();
+
+    pEvdev->startup.us[phase] += now - *t;
+    *t = now;
+}
+
+/**
+ * Log the breakdown and update the property. Called after the first
+ * EvdevOn.
+ */
+void
+EvdevStartupReport(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    CARD32 *us = pEvdev->startup.us;
+    CARD32 total = 0;
+    int i;
+
+    for (i = 0; i < EV_STARTUP_PHASES; i++)
+        total += us[i];
+
+    xf86Msg(X_INFO, "%s: startup took %u us: open %u, cache %u, probe %u, "
+            "preinit %u, keymap %u, classes %u, properties %u, on %u\n",
+            pInfo->name, total,
+            us[EV_STARTUP_OPEN], us[EV_STARTUP_CACHE], us[EV_STARTUP_PROBE],
+            us[EV_STARTUP_PREINIT], us[EV_STARTUP_KEYMAP],
+            us[EV_STARTUP_CLASSES], us[EV_STARTUP_PROPERTIES],
+            us[EV_STARTUP_ON]);
+
+    pEvdev->startup.reported = TRUE;
+
+#ifdef HAVE_PROPERTIES
+    if (prop_startup)
+    {
+        startup_updating = TRUE;
+        XIChangeDeviceProperty(pInfo->dev, prop_startup, XA_INTEGER, 32,
+                               PropModeReplace, EV_STARTUP_PHASES, us, FALSE);
+        startup_updating = FALSE;
+    }
+#endif
+}
+
+#ifdef HAVE_PROPERTIES
+static int
+EvdevStartupSetProperty(DeviceIntPtr dev, Atom atom, XIPropertyValuePtr val,
+                        BOOL checkonly)
+{
+    if (atom == prop_startup && !startup_updating)
+        return BadAccess; /* Read-only property */
+
+    return Success;
+}
+
+void
+EvdevStartupInitProperty(DeviceIntPtr dev)
+{
+    InputInfoPtr pInfo  = dev->public.devicePrivate;
+    EvdevPtr     pEvdev = pInfo->private;
+    int          rc;
+
+    prop_startup = MakeAtom(EVDEV_PROP_STARTUP_TIMES,
+                            strlen(EVDEV_PROP_STARTUP_TIMES), TRUE);
+    rc = XIChangeDeviceProperty(dev, prop_startup, XA_INTEGER, 32,
+                                PropModeReplace, EV_STARTUP_PHASES,
+                                pEvdev->startup.us, FALSE);
+    if (rc != Success)
+        return;
+
+    XISetDevicePropertyDeletable(dev, prop_startup, FALSE);
+
+    XIRegisterPropertyHandler(dev, EvdevStartupSetProperty, NULL, NULL);
+}
+#endif
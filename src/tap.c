@@ -0,0 +1,177 @@
+/*
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of the authors
+ * not be used in advertising or publicity pertaining to distribution
+ * of the software without specific, written prior permission.  The
+ * authors make no representations about the suitability of this software
+ * for any purpose.  It is provided "as is" without express or implied
+ * warranty.
+ *
+ * THE AUTHORS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Publishing of the device's events to the TapFile, see evdev-tap.h for
+ * the layout. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <xf86.h>
+#include <xf86Xinput.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "evdev.h"
+#include <evdev-tap.h>
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#define TAP_LEN (sizeof(EvdevTapHeader) + EVDEV_TAP_SIZE * sizeof(EvdevTapEntry))
+
+/**
+ * Append an entry to the tap. Called from the input handler, possibly in
+ * signal context.
+ */
+void
+EvdevTapWrite(EvdevPtr pEvdev, int kind, int type, int code, int value)
+{
+    EvdevTapHeader *header = pEvdev->tap.header;
+    EvdevTapEntry *entry;
+    uint32_t seq = pEvdev->tap.head++;
+
+    entry = (EvdevTapEntry*)(header + 1) + (seq & (EVDEV_TAP_SIZE - 1));
+
+    entry->seq = 0;
+    __sync_synchronize();
+    entry->kind = kind;
+    entry->type = type;
+    entry->code = code;
+    entry->value = value;
+    entry->sec = pEvdev->tap.time.tv_sec;
+    entry->usec = pEvdev->tap.time.tv_usec;
+    __sync_synchronize();
+    entry->seq = seq;
+    __sync_synchronize();
+    header->head = seq + 1;
+}
+
+/**
+ * Publish the valuators of a motion event as posted to the server.
+ */
+void
+EvdevTapMotion(EvdevPtr pEvdev, int kind, int first, int num, int *v)
+{
+    int i;
+
+    for (i = 0; i < num; i++)
+        EvdevTapWrite(pEvdev, kind, 0, first + i, v[i]);
+}
+
+/**
+ * Map the TapFile. An existing file is reused with its permissions, so an
+ * administrator can create it up front to let other users read it.
+ */
+void
+EvdevTapStart(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    EvdevTapHeader *header;
+    struct stat st;
+    int fd;
+
+    if (!pEvdev->tap_path || pEvdev->tap.header)
+        return;
+
+    fd = open(pEvdev->tap_path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+              0600);
+    if (fd == -1)
+    {
+        xf86Msg(X_ERROR, "%s: Cannot create tap %s: %s\n", pInfo->name,
+                pEvdev->tap_path, strerror(errno));
+        return;
+    }
+
+    /* Don't truncate a file someone else planted or linked there. */
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+        st.st_uid != geteuid() || st.st_nlink != 1)
+    {
+        xf86Msg(X_ERROR, "%s: Refusing tap %s: not a regular file owned by "
+                "the server\n", pInfo->name, pEvdev->tap_path);
+        close(fd);
+        return;
+    }
+
+    if (ftruncate(fd, TAP_LEN) == -1)
+    {
+        xf86Msg(X_ERROR, "%s: Cannot create tap %s: %s\n", pInfo->name,
+                pEvdev->tap_path, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    header = mmap(NULL, TAP_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        xf86Msg(X_ERROR, "%s: Cannot map tap %s: %s\n", pInfo->name,
+                pEvdev->tap_path, strerror(errno));
+        return;
+    }
+
+    memset(header, 0, TAP_LEN);
+    header->version = EVDEV_TAP_VERSION;
+    header->header_size = sizeof(EvdevTapHeader);
+    header->size = EVDEV_TAP_SIZE;
+    header->head = 1;
+    strncpy(header->name, pEvdev->name, sizeof(header->name) - 1);
+    __sync_synchronize();
+    /* the magic goes in last, readers check it before anything else */
+    memcpy(header->magic, EVDEV_TAP_MAGIC, sizeof(header->magic));
+
+    pEvdev->tap.head = 1;
+    pEvdev->tap.header = header;
+
+    xf86Msg(X_INFO, "%s: Publishing events to %s\n", pInfo->name,
+            pEvdev->tap_path);
+}
+
+void
+EvdevTapStop(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+
+    if (!pEvdev->tap.header)
+        return;
+
+    munmap(pEvdev->tap.header, TAP_LEN);
+    pEvdev->tap.header = NULL;
+}
+
+void
+EvdevTapPreInit(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+
+    pEvdev->tap.header = NULL;
+    pEvdev->tap_path = xf86CheckStrOption(pInfo->options, "TapFile", NULL);
+    if (pEvdev->tap_path)
+        xf86Msg(X_CONFIG, "%s: TapFile '%s'\n", pInfo->name,
+                pEvdev->tap_path);
+}
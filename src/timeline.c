@@ -0,0 +1,343 @@
+/*
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of the authors
+ * not be used in advertising or publicity pertaining to distribution
+ * of the software without specific, written prior permission.  The
+ * authors make no representations about the suitability of this software
+ * for any purpose.  It is provided "as is" without express or implied
+ * warranty.
+ *
+ * THE AUTHORS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Timeline tracing of the driver's activity to the TraceFile.
+ *
+ * The file is in the Trace Event JSON format and can be loaded into
+ * chrome://tracing or the Perfetto UI. Each device is a thread named after
+ * the device, each span a complete ("X") event. The closing bracket of the
+ * array is never written, the format allows for that, so a trace can be
+ * loaded while it is still being written.
+ *
+ * The input handler only stores the span in a buffer. The buffer is
+ * formatted and written out from a timer every EVDEV_TRACE_FLUSH ms, spans
+ * that don't fit until then are counted and dropped.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <X11/Xatom.h>
+#include <xf86.h>
+#include <xf86Xinput.h>
+#include <exevents.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <evdev-properties.h>
+#include "evdev.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#define EVDEV_TRACE_FLUSH 100   /* ms between writes */
+
+#ifdef HAVE_PROPERTIES
+static Atom prop_trace = 0; /* Tracing on/off */
+#endif
+
+static const char *trace_names[] = {
+    [EV_TRACE_READ]     = "read_input",
+    [EV_TRACE_FRAME]    = "frame",
+    [EV_TRACE_POST]     = "post",
+    [EV_TRACE_MBEMU]    = "mbemu_timer",
+    [EV_TRACE_REOPEN]   = "reopen",
+};
+
+/**
+ * @return The current time in microseconds.
+ */
+long long
+EvdevTraceNow(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/**
+ * Store a span that started at start and ends now. Called from the input
+ * handler, possibly in signal context.
+ */
+void
+EvdevTraceSpan(InputInfoPtr pInfo, int type, long long start)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    EvdevTraceSpanRec *span;
+
+    if (!start) /* tracing was started during the span */
+        return;
+
+    if (pEvdev->trace.num_spans >= EVDEV_TRACE_SPANS)
+    {
+        pEvdev->trace.dropped++;
+        return;
+    }
+
+    span = &pEvdev->trace.spans[pEvdev->trace.num_spans++];
+    span->type = type;
+    span->start = start;
+    span->dur = EvdevTraceNow() - start;
+}
+
+static BOOL
+EvdevTraceWrite(int fd, char *buf, int len)
+{
+    int n;
+
+    while (len > 0)
+    {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        buf += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Swap the span buffers and write out the spans collected so far.
+ */
+static BOOL
+EvdevTraceFlush(InputInfoPtr pInfo, int fd)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    EvdevTraceSpanRec *spans;
+    unsigned int i, num, dropped;
+    char buf[4096];
+    int len = 0;
+    int block;
+
+    block = xf86BlockSIGIO();
+    spans = pEvdev->trace.spans;
+    num = pEvdev->trace.num_spans;
+    dropped = pEvdev->trace.dropped;
+    pEvdev->trace.spans = pEvdev->trace.flush;
+    pEvdev->trace.flush = spans;
+    pEvdev->trace.num_spans = 0;
+    pEvdev->trace.dropped = 0;
+    xf86UnblockSIGIO(block);
+
+    if (dropped)
+        xf86Msg(X_WARNING, "%s: trace buffer full, %u spans dropped\n",
+                pInfo->name, dropped);
+
+    for (i = 0; i < num; i++)
+    {
+        if (len > sizeof(buf) - 256)
+        {
+            if (!EvdevTraceWrite(fd, buf, len))
+                return FALSE;
+            len = 0;
+        }
+
+        len += snprintf(buf + len, sizeof(buf) - len,
+                        "{\"name\":\"%s\",\"cat\":\"evdev\",\"ph\":\"X\","
+                        "\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d},\n",
+                        trace_names[spans[i].type], spans[i].start,
+                        spans[i].dur, (int)getpid(), pInfo->dev->id);
+    }
+
+    return EvdevTraceWrite(fd, buf, len);
+}
+
+static CARD32
+EvdevTraceTimer(OsTimerPtr timer, CARD32 time, pointer arg)
+{
+    InputInfoPtr pInfo = (InputInfoPtr)arg;
+    EvdevPtr pEvdev = pInfo->private;
+
+    if (!EvdevTraceFlush(pInfo, pEvdev->trace.fd))
+    {
+        xf86Msg(X_ERROR, "%s: Tracing stopped: %s\n", pInfo->name,
+                strerror(errno));
+        EvdevTraceStop(pInfo);
+        return 0;
+    }
+
+    return EVDEV_TRACE_FLUSH;
+}
+
+/**
+ * Open the TraceFile, write the device's name and start collecting spans.
+ *
+ * @return Success or the X error to return to the client.
+ */
+static int
+EvdevTraceStart(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    char buf[1280];
+    const char *c;
+    int fd, len;
+
+    if (pEvdev->trace.fd != -1)
+        return Success;
+
+    pEvdev->trace.spans = calloc(2 * EVDEV_TRACE_SPANS,
+                                 sizeof(EvdevTraceSpanRec));
+    if (!pEvdev->trace.spans)
+        return BadAlloc;
+    pEvdev->trace.flush = pEvdev->trace.spans + EVDEV_TRACE_SPANS;
+
+    fd = open(pEvdev->trace.path,
+              O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        xf86Msg(X_ERROR, "%s: Cannot open %s for tracing: %s\n",
+                pInfo->name, pEvdev->trace.path, strerror(errno));
+        free(pEvdev->trace.spans);
+        pEvdev->trace.spans = NULL;
+        return BadAccess;
+    }
+
+    len = snprintf(buf, sizeof(buf),
+                   "[\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                   "\"tid\":%d,\"args\":{\"name\":\"", (int)getpid(),
+                   pInfo->dev->id);
+    for (c = pInfo->name; *c && len < sizeof(buf) - 8; c++)
+        buf[len++] = (*c == '"' || *c == '\\' || *c < ' ') ? '_' : *c;
+    len += snprintf(buf + len, sizeof(buf) - len, "\"}},\n");
+
+    if (!EvdevTraceWrite(fd, buf, len))
+    {
+        xf86Msg(X_ERROR, "%s: Cannot write to %s: %s\n",
+                pInfo->name, pEvdev->trace.path, strerror(errno));
+        close(fd);
+        free(pEvdev->trace.spans);
+        pEvdev->trace.spans = NULL;
+        return BadAccess;
+    }
+
+    pEvdev->trace.num_spans = 0;
+    pEvdev->trace.dropped = 0;
+    pEvdev->trace.fd = fd;
+    pEvdev->trace.timer = TimerSet(pEvdev->trace.timer, 0, EVDEV_TRACE_FLUSH,
+                                   EvdevTraceTimer, pInfo);
+
+    xf86Msg(X_INFO, "%s: Tracing to %s\n", pInfo->name, pEvdev->trace.path);
+    return Success;
+}
+
+void
+EvdevTraceStop(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+    int fd, block;
+
+    if (pEvdev->trace.fd == -1)
+        return;
+
+    if (pEvdev->trace.timer)
+    {
+        TimerFree(pEvdev->trace.timer);
+        pEvdev->trace.timer = NULL;
+    }
+
+    block = xf86BlockSIGIO();
+    fd = pEvdev->trace.fd;
+    pEvdev->trace.fd = -1;
+    xf86UnblockSIGIO(block);
+
+    EvdevTraceFlush(pInfo, fd);
+    close(fd);
+
+    /* the buffers may be swapped, free the one calloc returned */
+    free(pEvdev->trace.spans < pEvdev->trace.flush ?
+         pEvdev->trace.spans : pEvdev->trace.flush);
+    pEvdev->trace.spans = NULL;
+    pEvdev->trace.flush = NULL;
+}
+
+void
+EvdevTracePreInit(InputInfoPtr pInfo)
+{
+    EvdevPtr pEvdev = pInfo->private;
+
+    pEvdev->trace.fd = -1;
+    pEvdev->trace.path = xf86CheckStrOption(pInfo->options, "TraceFile", NULL);
+    if (pEvdev->trace.path)
+        xf86Msg(X_CONFIG, "%s: TraceFile '%s'\n", pInfo->name,
+                pEvdev->trace.path);
+}
+
+#ifdef HAVE_PROPERTIES
+static int
+EvdevTraceSetProperty(DeviceIntPtr dev, Atom atom, XIPropertyValuePtr val,
+                      BOOL checkonly)
+{
+    InputInfoPtr pInfo  = dev->public.devicePrivate;
+
+    if (atom == prop_trace)
+    {
+        if (val->format != 8 || val->size != 1 || val->type != XA_INTEGER)
+            return BadMatch;
+
+        if (!checkonly)
+        {
+            if (*((CARD8*)val->data))
+                return EvdevTraceStart(pInfo);
+            EvdevTraceStop(pInfo);
+        }
+    }
+
+    return Success;
+}
+
+/**
+ * Initialise the tracing property. Like recording, only devices with a
+ * TraceFile get one.
+ */
+void
+EvdevTraceInitProperty(DeviceIntPtr dev)
+{
+    InputInfoPtr pInfo  = dev->public.devicePrivate;
+    EvdevPtr     pEvdev = pInfo->private;
+    BOOL         off    = FALSE;
+    int          rc;
+
+    if (!pEvdev->trace.path)
+        return;
+
+    prop_trace = MakeAtom(EVDEV_PROP_TRACE, strlen(EVDEV_PROP_TRACE), TRUE);
+    rc = XIChangeDeviceProperty(dev, prop_trace, XA_INTEGER, 8,
+                                PropModeReplace, 1, &off, FALSE);
+    if (rc != Success)
+        return;
+
+    XISetDevicePropertyDeletable(dev, prop_trace, FALSE);
+
+    XIRegisterPropertyHandler(dev, EvdevTraceSetProperty, NULL, NULL);
+}
+#endif